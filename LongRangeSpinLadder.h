@@ -3,6 +3,10 @@
 #include "hams.h"
 #include "fitting.h"
 #include "hambuilder.h"
+#include "siteterms.h"
+#include "mpocompress.h"
+#include "sparsempo.h"
+#include <map>
 
 #define Cout std::cout
 #define Endl std::endl
@@ -14,6 +18,24 @@ StaggerPinning(bool val)
     return Option("StaggerPinning",val);
     }
 
+//Build the MPO for a SpinHalfParity model
+Option inline
+SpinFlipParity(bool val = true)
+    {
+    return Option("SpinFlipParity",val);
+    }
+
+//Deparallelize the MPO; tol > 0 also truncates
+//its channels by SVD (see MPOCompressor). tol is a
+//per-block singular value cutoff on an MPO that is not
+//in canonical form, so it does not bound the error of
+//the Hamiltonian: check the energies against tol = 0
+Option inline
+CompressMPO(Real tol = 0)
+    {
+    return Option("CompressMPO",tol);
+    }
+
 
 class LongRangeSpinLadder : public MPOBuilder
     {
@@ -21,80 +43,495 @@ class LongRangeSpinLadder : public MPOBuilder
 
     LongRangeSpinLadder(const Model& model_,
                         const ExpFit& fit1, const ExpFit& fitXY, const ExpFit& fitZ,
-                        const Option& opt1 = Option(), const Option& opt2 = Option())
+                        const Option& opt1 = Option(), const Option& opt2 = Option(),
+                        const Option& opt3 = Option(), const Option& opt4 = Option())
         : 
         MPOBuilder(model_),
         initted_(false),
+        sparse_(false),
+        dense_(false),
         fit1_(fit1),
         fitXY_(fitXY),
         fitZ_(fitZ),
-        f_(0),
         pin_(0)
         {
-        parseOpts(opt1,opt2);
+        parseOpts(opt1,opt2,opt3,opt4);
         }
 
-    LongRangeSpinLadder(const Model& model_, const Callable& f,
+    //Interactions starting or ending on rung x
+    //are scaled by f(x); f can be any type with
+    //Real operator()(Real) const, including a Callable
+    template<class Function>
+    LongRangeSpinLadder(const Model& model_, const Function& f,
                         const ExpFit& fit1, const ExpFit& fitXY, const ExpFit& fitZ,
-                        const Option& opt1 = Option(), const Option& opt2 = Option())
+                        const Option& opt1 = Option(), const Option& opt2 = Option(),
+                        const Option& opt3 = Option(), const Option& opt4 = Option())
         : 
         MPOBuilder(model_),
         initted_(false),
+        sparse_(false),
+        dense_(false),
         fit1_(fit1),
         fitXY_(fitXY),
         fitZ_(fitZ),
-        f_(&f),
         pin_(0)
         { 
-        parseOpts(opt1,opt2);
+        parseOpts(opt1,opt2,opt3,opt4);
+
+        //Tabulate f once instead of evaluating it per site and operator
+        smooth_.resize(model.NN()/2+2);
+        for(int x = 1; x < int(smooth_.size()); ++x)
+            smooth_.at(x) = f(x);
         }
 
     operator const IQMPO&() { init(); return QH; }
 
+    //Just the term tables, for dmrg with a LocalSparseMPO
+    operator const SparseMPO&()
+        {
+        if(S_.isNull())
+            {
+            sparse_ = true;
+            build();
+            sparse_ = false;
+            }
+        return S_;
+        }
+
+    //Bond dimension k of the MPO built from these fits
+    static int
+    bondDimension(const ExpFit& fit1, const ExpFit& fitXY, const ExpFit& fitZ)
+        {
+        if(sharedLambdas(fit1,fitXY,fitZ))
+            return 6*sharedChannels(fit1,fitXY,fitZ)+2;
+        const int ko1 = 2*fit1.nchannel(),
+                  koXY = 2*fitXY.nchannel(),
+                  koZ = 2*fitZ.nchannel();
+        return 2*ko1+2*koXY + ko1+koZ+2;
+        }
+
+    //Built straight from the term tables, without an IQMPO
     operator const MPO&() 
         { 
-        init(); 
         if(H.isNull())
-            H = QH.toMPO();
+            {
+            dense_ = true;
+            build();
+            dense_ = false;
+            }
         return H; 
         }
 
+    //
+    // Brings the Hamiltonians already made up to date
+    // after fitXY, which this object refers to, was refit
+    // (say for another LambdaXY): only the change of the
+    // rung XY terms is added to each site, leaving the leg
+    // and Z channels and all indices as they are. Returns
+    // false, changing nothing, if the new fit needs other
+    // channels, or with shared channels, compression or
+    // spin flip parity; the MPO must then be made anew.
+    //
+    bool
+    updateFitXY();
+
     private:
 
     /////////////
     //
     // Data Members
 
-    bool initted_;
+    bool initted_,
+         sparse_,
+         dense_;
 
     const ExpFit &fit1_,
                  &fitXY_,
                  &fitZ_;
     IQMPO QH;
     MPO H;
+    SparseMPO S_;
 
-    const Callable* f_;
+    //Smoothing factor for each rung, empty if not smoothing
+    std::vector<Real> smooth_;
 
     Real pin_;
     bool stagger_pinning_;
 
+    bool compress_;
+    Real compress_tol_;
+
+    bool parity_;
+
+    //What updateFitXY needs of the last build
+    ExpFit builtXY_;
+    std::vector<SiteTerms> tables_;
+    std::vector<IQIndex> iqlinks_;
+    std::vector<Index> q0_;
+    //Prototype of each site stamped by stampSite, the site
+    //itself for prototypes and 0 for sites built on their own
+    std::vector<int> proto_;
+
     //
     /////////////
 
     void
-    parseOpts(const Option& opt1, const Option& opt2)
+    parseOpts(const Option& opt1, const Option& opt2, const Option& opt3, const Option& opt4)
         {
-        OptionSet oset(opt1,opt2);
+        OptionSet oset(opt1,opt2,opt3,opt4);
         pin_ = oset.realOrDefault("Pinning",0);
         stagger_pinning_ = oset.boolOrDefault("StaggerPinning",false);
+        compress_ = oset.defined("CompressMPO");
+        compress_tol_ = oset.realOrDefault("CompressMPO",0);
+        parity_ = oset.boolOrDefault("SpinFlipParity",false);
+        }
+
+    //Fits made by ExpFit::fitJointly share their lambdas,
+    //letting leg and rung terms use the same channels
+    static bool
+    sharedLambdas(const ExpFit& fit1, const ExpFit& fitXY, const ExpFit& fitZ)
+        {
+        return fit1.sharesLambdas(fitXY) && fit1.sharesLambdas(fitZ);
+        }
+
+    static int
+    sharedChannels(const ExpFit& fit1, const ExpFit& fitXY, const ExpFit& fitZ)
+        {
+        int p = fit1.nexp();
+        for(int l = 1; l <= fit1.nexp(); ++l) 
+            if(fit1.isComplex(l) || fitXY.isComplex(l) || fitZ.isComplex(l)) ++p;
+        return p;
+        }
+
+    //Link indices carrying nPM channels in each of the
+    //QN -2 and +2 blocks and n0 in the QN 0 block
+    void
+    makeLinks(std::vector<IQIndex>& iqlinks, std::vector<Index>& q0,
+              int nPM, int n0) const
+        {
+        std::vector<int> s(3,nPM);
+        s[2] = n0;
+        makeLinks(iqlinks,q0,std::vector<std::vector<int> >(model.NN()+1,s));
+        }
+
+    //Links for SpinHalfParity: the channels of block 1 of
+    //sizes[i] are parity odd, those of block 2 even (block 0
+    //is empty); q0 gets the even part, which holds ds and k
+    void
+    makeParityLinks(std::vector<IQIndex>& iqlinks, std::vector<Index>& q0,
+                    const std::vector<std::vector<int> >& sizes) const
+        {
+        const int N = model.NN();
+        iqlinks.resize(N+1);
+        q0.resize(N+1);
+
+        for(int i = 0; i <= N; ++i)
+            {
+            Index qO(nameint("qO_",i),sizes.at(i).at(1));
+            q0.at(i) = Index(nameint("q0_",i),sizes.at(i).at(2));
+
+            iqlinks.at(i) = IQIndex(nameint("hl",i),
+                                    qO,QN(0,0,1),
+                                    q0[i],QN(0,0,0));
+            }
+        }
+
+    //Same with sizes[i] = (nP, nM, n0) for link i
+    void
+    makeLinks(std::vector<IQIndex>& iqlinks, std::vector<Index>& q0,
+              const std::vector<std::vector<int> >& sizes) const
+        {
+        const int N = model.NN();
+        iqlinks.resize(N+1);
+        q0.resize(N+1);
+
+        //The names of these indices refer to their Nf quantum numbers (plus or minus), 
+        //but they can have various sz quantum numbers depending on the type of site they follow
+        std::vector<Index> qP(N+1), 
+                           qM(N+1);
+
+        for(int i = 0; i <= N; ++i)
+            {
+            qP.at(i) = Index(nameint("qP_",i),sizes.at(i).at(0));
+            qM.at(i) = Index(nameint("qM_",i),sizes.at(i).at(1));
+            q0.at(i) = Index(nameint("q0_",i),sizes.at(i).at(2));
+
+            iqlinks.at(i) = IQIndex(nameint("hl",i),
+                                    qP[i],QN(-2),
+                                    qM[i],QN(+2),
+                                    q0[i],QN( 0));
+            }
+        }
+
+    //
+    // Bulk sites of one leg with the same smoothing
+    // factor have the same W up to index labels, so
+    // site j reuses an earlier one where possible: a
+    // copy of an IQTensor shares its storage until
+    // written to, so this also saves the memory.
+    // Returns false (recording j as the prototype if
+    // it can be one) if W must be built for site j.
+    //
+    bool
+    stampSite(std::map<std::pair<int,Real>,int>& protos, int j, int leg, int xj,
+              const std::vector<IQIndex>& iqlinks)
+        {
+        //Pinned sites are one of a kind
+        if(j < 3 && pin_ != 0) return false;
+
+        const std::pair<int,Real> key(leg,(smooth_.empty() ? 1. : smooth_.at(xj)));
+        std::map<std::pair<int,Real>,int>::const_iterator it = protos.find(key);
+        if(it == protos.end())
+            {
+            protos[key] = j;
+            proto_.at(j) = j;
+            return false;
+            }
+
+        proto_.at(j) = it->second;
+        copySite(it->second,j,iqlinks);
+        return true;
+        }
+
+    //W of site j0 relabeled for site j, mapping each index
+    //as W has it: conj(si), siP, conj(link j-1), link j
+    void
+    copySite(int j0, int j, const std::vector<IQIndex>& iqlinks)
+        {
+        IQTensor& W = QH.AAnc(j);
+        W = QH.AA(j0);
+        W.mapindex(conj(model.si(j0)),conj(model.si(j)));
+        W.mapindex(model.siP(j0),model.siP(j));
+        W.mapindex(conj(iqlinks.at(j0-1)),conj(iqlinks.at(j-1)));
+        W.mapindex(iqlinks.at(j0),iqlinks.at(j));
+        }
+
+#ifdef DEBUG
+    //A stamped W must equal the one built from its terms
+    void
+    checkStamp(int j, const SiteTerms& terms, const IQIndex& row, const IQIndex& col) const
+        {
+        IQTensor Wf(conj(model.si(j)),model.siP(j),row,col);
+        terms.addTo(Wf,model,j,row,col);
+        IQTensor diff(QH.AA(j));
+        diff -= Wf;
+        if(diff.norm() > 1E-12*Wf.norm())
+            Error(nameint("LongRangeSpinLadder: stamped W differs from a fresh one at site ",j));
+        }
+#endif
+
+    //Onsite pinning field
+    void
+    addPinning(SiteTerms& terms, int j, int k, int ds) const
+        {
+        if(j < 3 && pin_ != 0)
+            {
+            if(stagger_pinning_)
+                {
+                Real pval = (j%2 == 1 ? +pin_ : -pin_);
+                Cout << Format("Including *staggered* pinning at site %d, strength %.10f") % j % pval << Endl;
+                terms.add(k,ds,SiteTerms::Sx,pval);
+                }
+            else
+                {
+                Cout << Format("Including pinning at site %d, strength %.10f") % j % pin_ << Endl;
+                terms.add(k,ds,SiteTerms::Sx,pin_);
+                }
+            }
+        }
+
+    //
+    // Interactions between legs of one operator type (1:
+    // S+S-, 2: S-S+, 3: SzSz) for site j of the separate
+    // layout, in the channels of fit from r on; every
+    // coefficient is multiplied by fac, so fac = -1 gives
+    // the terms to take away when fit is replaced.
+    //
+    void
+    addRungTerms(SiteTerms& terms, int type, const ExpFit& fit, Real fac,
+                 int j, int r, int ds, int k) const
+        {
+        const int leg = (j%2==1 ? 1 : 2),
+                  xj = (j/2)+1;
+
+        //S+ S- interactions by default
+        SiteTerms::OpType start_op = SiteTerms::Sp,
+                          end_op = SiteTerms::Sm;
+        Real start_fac = 0.5*fac,
+             end_fac = fac;
+        if(type == 2)
+            {
+            start_op = SiteTerms::Sm;
+            end_op = SiteTerms::Sp;
+            }
+        else if(type == 3)
+            {
+            start_op = SiteTerms::Sz;
+            start_fac = fac;
+            end_op = SiteTerms::Sz;
+            }
+
+        if(!smooth_.empty())
+            {
+            start_fac *= smooth_.at(xj);
+            end_fac *= smooth_.at(xj);
+            }
+
+        //Iterate over legs: a = 1,2
+        for(int a = 1; a <= 2; ++a)
+            {
+            bool this_leg = (a == leg);
+            //Iterate over exponentials in the fit l = 1,2,...,p
+            for(int l = 1; l <= fit.nexp(); ++l)
+                {
+                if(this_leg)
+                    {
+                    terms.add(r,r,SiteTerms::Id,fit.ReLambda()(l)*fac);
+                    if(leg == 1)
+                        terms.add(k,r,start_op,fit.ReChi()(l)*start_fac);
+                    else
+                        terms.add(k,r,start_op,fit.ReLambda()(l)*fit.ReChi()(l)*start_fac);
+                    }
+                else
+                    {
+                    terms.add(r,r,SiteTerms::Id,fac);
+                    terms.add(r,ds,end_op,fit.ReLambda()(l)*end_fac);
+                    }
+                ++r;
+                if(fit.isComplex(l))
+                    {
+                    if(this_leg)
+                        {
+                        terms.add(r,r,SiteTerms::Id,fit.ReLambda()(l)*fac);
+                        terms.add(r-1,r,SiteTerms::Id,-fit.ImLambda()(l)*fac);
+                        terms.add(r,r-1,SiteTerms::Id,fit.ImLambda()(l)*fac);
+
+                        if(leg == 1)
+                            {
+                            terms.add(k,r,start_op,-fit.ImChi()(l)*start_fac);
+                            }
+                        else
+                            {
+                            terms.add(k,r-1,start_op,-fit.ImLambda()(l)*fit.ImChi()(l)*start_fac);
+                            terms.add(k,r,start_op,-fit.ImLambda()(l)*fit.ReChi()(l)*start_fac);
+                            terms.add(k,r,start_op,-fit.ReLambda()(l)*fit.ImChi()(l)*start_fac);
+                            }
+                        }
+                    else
+                        {
+                        terms.add(r,r,SiteTerms::Id,fac);
+                        terms.add(r-1,ds,end_op,-fit.ImLambda()(l)*end_fac);
+                        terms.add(r,ds,end_op,(fit.ImLambda()(l)+fit.ReLambda()(l))*end_fac);
+                        }
+                    ++r;
+                    }
+                } //for l
+            } //for a
+        }
+
+    //Whether the builders collect the tables of all sites
+    //and hand them to finishTables instead of making W
+    bool
+    keepTables() const { return compress_ || parity_ || sparse_ || dense_; }
+
+    //
+    // Compresses the term tables of all sites if asked
+    // (channels 1..nPM in the QN -2 block, nPM+1..2nPM
+    // in +2, the rest in 0) and with parity_ rewrites them
+    // for SpinHalfParity, where the S+S- channels, ds and
+    // k are parity even and the S-S+ and Sz channels odd.
+    // Returns true if the tables went into S_ (sparse_) or
+    // H (dense_); otherwise remakes the links with the new
+    // block sizes and builds every W.
+    //
+    bool
+    finishTables(std::vector<SiteTerms>& tables, int nPM, int ds, int k,
+                 std::vector<IQIndex>& iqlinks, std::vector<Index>& q0)
+        {
+        const int N = model.NN();
+
+        std::vector<int> sector(k+1,2);
+        for(int c = 1; c <= 2*nPM; ++c)
+            sector.at(c) = (c <= nPM ? 0 : 1);
+
+        if(parity_)
+            {
+            for(int c = 1; c <= k; ++c)
+                sector.at(c) = (c <= nPM || c == ds || c == k ? 2 : 1);
+            for(int j = 1; j <= N; ++j)
+                tables.at(j).toParityFrame(k);
+            }
+
+        int start = k,
+            end = ds;
+        std::vector<std::vector<int> > sizes;
+        if(compress_ || parity_)
+            {
+            MPOCompressor comp(tables,sector,ds,k);
+            if(compress_)
+                {
+                comp.compress(compress_tol_);
+                Cout << Format("Compressed MPO (tol %.1E): k = %d -> max k = %d") 
+                        % compress_tol_ % k % comp.maxBondDim() << Endl;
+                }
+            comp.result(tables,sizes);
+
+            //The outer bonds are only reordered, k last and ds first in block 2
+            start = sizes.at(0).at(0)+sizes.at(0).at(1)+sizes.at(0).at(2);
+            end = sizes.at(N).at(0)+sizes.at(N).at(1)+1;
+            }
+
+        if(sparse_)
+            {
+            S_ = SparseMPO(model,tables,start,end);
+            return true;
+            }
+        if(dense_)
+            {
+            std::vector<int> dims(N+1,k);
+            for(size_t i = 0; i < sizes.size(); ++i)
+                dims.at(i) = sizes.at(i).at(0)+sizes.at(i).at(1)+sizes.at(i).at(2);
+            denseMPO(model,tables,dims,start,end,H);
+            return true;
+            }
+
+        if(parity_)
+            makeParityLinks(iqlinks,q0,sizes);
+        else
+            makeLinks(iqlinks,q0,sizes);
+
+        for(int j = 1; j <= N; ++j)
+            {
+            IQTensor &W = QH.AAnc(j);
+            IQIndex row = conj(iqlinks.at(j-1)),
+                    col = iqlinks.at(j);
+            W = IQTensor(conj(model.si(j)),model.siP(j),row,col);
+            tables.at(j).addTo(W,model,j,row,col);
+            }
+        return false;
         }
 
     void
     init()
         {
         if(initted_) return;
+        build();
+        initted_ = true;
+        }
 
-        QH = IQMPO(model);
+    void
+    build()
+        {
+        if(sharedLambdas(fit1_,fitXY_,fitZ_))
+            initShared();
+        else
+            initSeparate();
+        }
+
+    void
+    initSeparate()
+        {
+        if(!sparse_ && !dense_) QH = IQMPO(model);
         const int N = model.NN();
 
         //Determine number of complex chi's
@@ -145,97 +582,74 @@ class LongRangeSpinLadder : public MPOBuilder
         //std::cout << "kd = " << kd << std::endl;
         //std::cout << "k  = " << k << std::endl;
 
-        std::vector<IQIndex> iqlinks(N+1);
-
-        //The names of these indices refer to their Nf quantum numbers (plus or minus), 
-        //but they can have various sz quantum numbers depending on the type of site they follow
-        std::vector<Index> q0(N+1),
-                           qP(N+1), 
-                           qM(N+1);
-
-        for(int i = 0; i <= N; ++i)
-            {
-            qP.at(i) = Index(nameint("qP_",i),ko1+koXY);
-            qM.at(i) = Index(nameint("qM_",i),ko1+koXY);
-            q0.at(i) = Index(nameint("q0_",i),kd);
-
-            iqlinks.at(i) = IQIndex(nameint("hl",i),
-                                    qP[i],QN(-2),
-                                    qM[i],QN(+2),
-                                    q0[i],QN( 0));
-            }
-
-        std::vector<Index> start_inds(1); 
-        start_inds[0] = q0.at(0);
-
-        std::vector<Index> end_inds(1); 
-        end_inds[0] = q0.at(N);
+        //Channels are ordered as [leg S+ | rung S+] (QN -2), 
+        //[leg S- | rung S-] (QN +2), then the diagonal part
+        std::vector<IQIndex> iqlinks;
+        std::vector<Index> q0;
+        makeLinks(iqlinks,q0,ko1+koXY,kd);
 
+        SiteTerms terms;
+        std::vector<SiteTerms> tables(keepTables() ? N+1 : 0);
+        std::map<std::pair<int,Real>,int> protos;
+        proto_.assign(N+1,0);
         for(int j = 1; j <= N; ++j)
             {
-            //Create j^th A (an IQTensor)
-            IQTensor &W = QH.AAnc(j);
             IQIndex row = conj(iqlinks.at(j-1)),
                     col = iqlinks.at(j);
 
             int leg = (j%2==1 ? 1 : 2);
 
-            const Real xj = (j/2)+1;
+            const int xj = (j/2)+1;
 
-            W = IQTensor(conj(model.si(j)),model.siP(j),row,col);
+            const bool stamped = (!keepTables() && stampSite(protos,j,leg,xj,iqlinks));
+#ifndef DEBUG
+            if(stamped) continue;
+#endif
+
+            terms.clear();
 
             //Identity string operators
-            W += model.id(j) * row(ds) * col(ds);
-            W += model.id(j) * row(k) * col(k);
+            terms.add(ds,ds,SiteTerms::Id);
+            terms.add(k,k,SiteTerms::Id);
 
-            //Onsite pinning field
-            if(j < 3 && pin_ != 0)
-                {
-                if(stagger_pinning_)
-                    {
-                    Real pval = (j%2 == 1 ? +pin_ : -pin_);
-                    Cout << Format("Including *staggered* pinning at site %d, strength %.10f") % j % pval << Endl;
-                    W += model.sx(j) * row(k) * col(ds) * pval;
-                    }
-                else
-                    {
-                    Cout << Format("Including pinning at site %d, strength %.10f") % j % pin_ << Endl;
-                    W += model.sx(j) * row(k) * col(ds) * pin_;
-                    }
-                }
+            addPinning(terms,j,k,ds);
 
             //Long range Heisenberg interactions along legs
             for(int type = 1; type <= 3; ++type)
                 {
                 int r = 0;
-                IQTensor start_op, end_op;
+                SiteTerms::OpType start_op = SiteTerms::Id, 
+                                  end_op = SiteTerms::Id;
+                Real start_fac = 1, 
+                     end_fac = 1;
                 if(type == 1)
                     {
                     //S+ S- interactions
                     r = 1;
                     //std::cout << "Starting r = 2 = " << r << std::endl;
-                    start_op = model.sp(j)*0.5;
-                    end_op = model.sm(j);
+                    start_op = SiteTerms::Sp;
+                    start_fac = 0.5;
+                    end_op = SiteTerms::Sm;
                     }
                 else if(type == 2)
                     {
-                    r = ko1+1;
-                    //std::cout << "Starting r = ko1+2 = " << r << std::endl;
-                    start_op = model.sm(j)*0.5;
-                    end_op = model.sp(j);
+                    r = ko1+koXY+1;
+                    start_op = SiteTerms::Sm;
+                    start_fac = 0.5;
+                    end_op = SiteTerms::Sp;
                     }
                 else if(type == 3)
                     {
                     r = ds+1;
                     //std::cout << "Starting r = ds+2 = " << r << std::endl;
-                    start_op = model.sz(j);
-                    end_op = model.sz(j);
+                    start_op = SiteTerms::Sz;
+                    end_op = SiteTerms::Sz;
                     }
 
-                if(f_ != 0)
+                if(!smooth_.empty())
                     {
-                    start_op *= (*f_)(xj);
-                    end_op *= (*f_)(xj);
+                    start_fac *= smooth_.at(xj);
+                    end_fac *= smooth_.at(xj);
                     }
 
                 //Iterate over legs: a = 1,2
@@ -247,28 +661,28 @@ class LongRangeSpinLadder : public MPOBuilder
                         {
                         if(this_leg)
                             {
-                            W += model.id(j)*row(r)*col(r);
-                            W += end_op*row(r)*col(ds);
-                            W += fit1_.ReChi()(l)*start_op*row(k)*col(r);
+                            terms.add(r,r,SiteTerms::Id);
+                            terms.add(r,ds,end_op,end_fac);
+                            terms.add(k,r,start_op,fit1_.ReChi()(l)*start_fac);
                             }
                         else
                             {
-                            W += fit1_.ReLambda()(l)*model.id(j)*row(r)*col(r);
+                            terms.add(r,r,SiteTerms::Id,fit1_.ReLambda()(l));
                             }
                         ++r;
                         if(iscomplex1.at(l))
                             {
                             if(this_leg)
                                 {
-                                W += model.id(j)*row(r)*col(r);
-                                W += end_op*row(r)*col(ds);
-                                W += -fit1_.ImChi()(l)*start_op*row(k)*col(r);
+                                terms.add(r,r,SiteTerms::Id);
+                                terms.add(r,ds,end_op,end_fac);
+                                terms.add(k,r,start_op,-fit1_.ImChi()(l)*start_fac);
                                 }
                             else
                                 {
-                                W += fit1_.ReLambda()(l)*model.id(j)*row(r)*col(r);
-                                W += -fit1_.ImLambda()(l)*model.id(j)*row(r-1)*col(r);
-                                W += fit1_.ImLambda()(l)*model.id(j)*row(r)*col(r-1);
+                                terms.add(r,r,SiteTerms::Id,fit1_.ReLambda()(l));
+                                terms.add(r-1,r,SiteTerms::Id,-fit1_.ImLambda()(l));
+                                terms.add(r,r-1,SiteTerms::Id,fit1_.ImLambda()(l));
                                 }
                             ++r;
                             }
@@ -278,93 +692,189 @@ class LongRangeSpinLadder : public MPOBuilder
                 } //for type
 
             //Interactions between legs
+            addRungTerms(terms,1,fitXY_,1,j,ko1+1,ds,k);
+            addRungTerms(terms,2,fitXY_,1,j,2*ko1+koXY+1,ds,k);
+            addRungTerms(terms,3,fitZ_,1,j,ds+ko1+1,ds,k);
+
+            if(keepTables())
+                {
+                tables.at(j) = terms;
+                continue;
+                }
+
+#ifdef DEBUG
+            if(stamped)
+                {
+                checkStamp(j,terms,row,col);
+                continue;
+                }
+#endif
+
+            //Create j^th A (an IQTensor)
+            IQTensor &W = QH.AAnc(j);
+            W = IQTensor(conj(model.si(j)),model.siP(j),row,col);
+            terms.addTo(W,model,j,row,col);
+            }
+
+        builtXY_ = fitXY_;
+        //Kept for updateFitXY
+        if(keepTables())
+            {
+            if(!compress_ && !parity_) tables_ = tables;
+            }
+        else
+            {
+            iqlinks_ = iqlinks;
+            q0_ = q0;
+            }
+
+        if(keepTables() && finishTables(tables,ko1+koXY,ds,k,iqlinks,q0)) return;
+
+        std::vector<Index> start_inds(1); 
+        start_inds[0] = q0.at(0);
+
+        std::vector<Index> end_inds(1); 
+        end_inds[0] = q0.at(N);
+
+        QH.AAnc(1) = makeLedge(iqlinks.at(0),start_inds) * QH.AA(1);
+        QH.AAnc(N) = QH.AA(N) * makeRedge(conj(iqlinks.at(N)),end_inds); 
+        }
+
+    //
+    // Layout for fits sharing their lambdas. A channel is
+    // started (weight 1) on a site of leg a and picks up
+    // lambda on every site of the other leg, so it serves
+    // both interactions of its operator type: it ends on
+    // leg a with the leg weight chi1, or on the other leg
+    // with the rung weight times lambda (a = 1) or lambda^2
+    // (a = 2), since there the rung distance is one or two
+    // larger than the number of lambdas picked up.
+    // Complex exponentials carry (Re,-Im) of lambda^n in a
+    // 2x2 block. This needs 6p+2 channels in all instead
+    // of 6p1+4pXY+2pZ+2.
+    //
+    void
+    initShared()
+        {
+        if(!sparse_ && !dense_) QH = IQMPO(model);
+        const int N = model.NN();
+        const int ne = fit1_.nexp();
+
+        //An exponential takes two channels if complex in any of the fits
+        std::vector<bool> iscomplex(ne+1,false);
+        for(int l = 1; l <= ne; ++l) 
+            iscomplex.at(l) = (fit1_.isComplex(l) || fitXY_.isComplex(l) || fitZ_.isComplex(l));
+
+        const int p = sharedChannels(fit1_,fitXY_,fitZ_),
+                  ds = 4*p+1,      //start of diagonal part
+                  kd = 2*p+2,      //bond dimension of diagonal part
+                  k  = (ds-1)+kd;  //total bond dimension
+
+        std::vector<IQIndex> iqlinks;
+        std::vector<Index> q0;
+        makeLinks(iqlinks,q0,2*p,kd);
+
+        SiteTerms terms;
+        std::vector<SiteTerms> tables(keepTables() ? N+1 : 0);
+        std::map<std::pair<int,Real>,int> protos;
+        proto_.assign(N+1,0);
+        for(int j = 1; j <= N; ++j)
+            {
+            IQIndex row = conj(iqlinks.at(j-1)),
+                    col = iqlinks.at(j);
+
+            int leg = (j%2==1 ? 1 : 2);
+
+            const int xj = (j/2)+1;
+
+            const bool stamped = (!keepTables() && stampSite(protos,j,leg,xj,iqlinks));
+#ifndef DEBUG
+            if(stamped) continue;
+#endif
+
+            terms.clear();
+
+            //Identity string operators
+            terms.add(ds,ds,SiteTerms::Id);
+            terms.add(k,k,SiteTerms::Id);
+
+            addPinning(terms,j,k,ds);
+
             for(int type = 1; type <= 3; ++type)
                 {
                 int r = 0;
-                IQTensor start_op, end_op;
+                SiteTerms::OpType start_op = SiteTerms::Id, 
+                                  end_op = SiteTerms::Id;
+                Real start_fac = 1, 
+                     end_fac = 1;
                 const ExpFit* pfit = 0;
-                const std::vector<bool>* piscomplex = 0;
-
                 if(type == 1)
                     {
                     //S+ S- interactions
-                    r = 2*ko1+1;
-                    //std::cout << "Starting r = 2 = " << r << std::endl;
-                    start_op = model.sp(j)*0.5;
-                    end_op = model.sm(j);
+                    r = 1;
+                    start_op = SiteTerms::Sp;
+                    start_fac = 0.5;
+                    end_op = SiteTerms::Sm;
                     pfit = &fitXY_;
-                    piscomplex = &iscomplexXY;
                     }
                 else if(type == 2)
                     {
-                    r = 2*ko1+koXY+1;
-                    //std::cout << "Starting r = ko1+2 = " << r << std::endl;
-                    start_op = model.sm(j)*0.5;
-                    end_op = model.sp(j);
+                    r = 2*p+1;
+                    start_op = SiteTerms::Sm;
+                    start_fac = 0.5;
+                    end_op = SiteTerms::Sp;
                     pfit = &fitXY_;
-                    piscomplex = &iscomplexXY;
                     }
                 else if(type == 3)
                     {
-                    r = ds+ko1+1;
-                    //std::cout << "Starting r = ds+2 = " << r << std::endl;
-                    start_op = model.sz(j);
-                    end_op = model.sz(j);
+                    r = ds+1;
+                    start_op = SiteTerms::Sz;
+                    end_op = SiteTerms::Sz;
                     pfit = &fitZ_;
-                    piscomplex = &iscomplexZ;
                     }
 
-                if(f_ != 0)
+                if(!smooth_.empty())
                     {
-                    start_op *= (*f_)(xj);
-                    end_op *= (*f_)(xj);
+                    start_fac *= smooth_.at(xj);
+                    end_fac *= smooth_.at(xj);
                     }
 
                 //Iterate over legs: a = 1,2
                 for(int a = 1; a <= 2; ++a)
                     {
                     bool this_leg = (a == leg);
-                    //Iterate over exponentials in the fit l = 1,2,...,p
-                    for(int l = 1; l <= pfit->nexp(); ++l) 
+                    for(int l = 1; l <= ne; ++l) 
                         {
+                        const Cplx lambda(fit1_.ReLambda()(l),fit1_.ImLambda()(l));
+                        const Cplx wleg(fit1_.ReChi()(l),fit1_.ImChi()(l));
+                        Cplx wrung = Cplx(pfit->ReChi()(l),pfit->ImChi()(l))*lambda;
+                        if(a == 2) wrung *= lambda;
+
                         if(this_leg)
                             {
-                            W += pfit->ReLambda()(l)*model.id(j)*row(r)*col(r);
-                            if(leg == 1)
-                                W += pfit->ReChi()(l)*start_op*row(k)*col(r);
-                            else
-                                W += pfit->ReLambda()(l)*pfit->ReChi()(l)*start_op*row(k)*col(r);
+                            terms.add(r,r,SiteTerms::Id);
+                            terms.add(k,r,start_op,start_fac);
+                            terms.add(r,ds,end_op,wleg.a*end_fac);
                             }
                         else
                             {
-                            W += model.id(j)*row(r)*col(r);
-                            W += pfit->ReLambda()(l)*end_op*row(r)*col(ds);
+                            terms.add(r,r,SiteTerms::Id,lambda.a);
+                            terms.add(r,ds,end_op,wrung.a*end_fac);
                             }
                         ++r;
-                        if(piscomplex->at(l))
+                        if(iscomplex.at(l))
                             {
                             if(this_leg)
                                 {
-                                W += pfit->ReLambda()(l)*model.id(j)*row(r)*col(r);
-                                W += -pfit->ImLambda()(l)*model.id(j)*row(r-1)*col(r);
-                                W += pfit->ImLambda()(l)*model.id(j)*row(r)*col(r-1);
-
-                                if(leg == 1)
-                                    {
-                                    W += -pfit->ImChi()(l)*start_op*row(k)*col(r);
-                                    }
-                                else
-                                    {
-                                    W += -pfit->ImLambda()(l)*pfit->ImChi()(l)*start_op*row(k)*col(r-1);
-                                    W += -pfit->ImLambda()(l)*pfit->ReChi()(l)*start_op*row(k)*col(r);
-                                    W += -pfit->ReLambda()(l)*pfit->ImChi()(l)*start_op*row(k)*col(r);
-                                    }
+                                terms.add(r,r,SiteTerms::Id);
+                                terms.add(r,ds,end_op,wleg.b*end_fac);
                                 }
                             else
                                 {
-                                W += model.id(j)*row(r)*col(r);
-                                W += -pfit->ImLambda()(l)*end_op*row(r-1)*col(ds);
-                                W += (pfit->ImLambda()(l)+pfit->ReLambda()(l))*end_op*row(r)*col(ds);
+                                terms.add(r,r,SiteTerms::Id,lambda.a);
+                                terms.add(r-1,r,SiteTerms::Id,-lambda.b);
+                                terms.add(r,r-1,SiteTerms::Id,lambda.b);
+                                terms.add(r,ds,end_op,wrung.b*end_fac);
                                 }
                             ++r;
                             }
@@ -373,16 +883,125 @@ class LongRangeSpinLadder : public MPOBuilder
 
                 } //for type
 
+            if(keepTables())
+                {
+                tables.at(j) = terms;
+                continue;
+                }
+
+#ifdef DEBUG
+            if(stamped)
+                {
+                checkStamp(j,terms,row,col);
+                continue;
+                }
+#endif
+
+            //Create j^th A (an IQTensor)
+            IQTensor &W = QH.AAnc(j);
+            W = IQTensor(conj(model.si(j)),model.siP(j),row,col);
+            terms.addTo(W,model,j,row,col);
             }
 
+        if(keepTables() && finishTables(tables,2*p,ds,k,iqlinks,q0)) return;
+
+        std::vector<Index> start_inds(1); 
+        start_inds[0] = q0.at(0);
+
+        std::vector<Index> end_inds(1); 
+        end_inds[0] = q0.at(N);
+
         QH.AAnc(1) = makeLedge(iqlinks.at(0),start_inds) * QH.AA(1);
         QH.AAnc(N) = QH.AA(N) * makeRedge(conj(iqlinks.at(N)),end_inds); 
-
-        initted_ = true;
         }
 
     };
 
+bool inline LongRangeSpinLadder::
+updateFitXY()
+    {
+    if(sharedLambdas(fit1_,fitXY_,fitZ_) || compress_ || parity_) return false;
+    if(builtXY_.nexp() != fitXY_.nexp()) return false;
+    for(int l = 1; l <= fitXY_.nexp(); ++l)
+        if(builtXY_.isComplex(l) != fitXY_.isComplex(l)) return false;
+
+    const int N = model.NN();
+    const int ko1 = 2*fit1_.nchannel(),
+              koXY = 2*fitXY_.nchannel(),
+              koZ = 2*fitZ_.nchannel(),
+              ds = 2*ko1+2*koXY+1,
+              k = ds+ko1+koZ+1;
+
+    //Sites sharing a prototype get the same change: it is
+    //added to the first of them away from the edges, which
+    //the others are then stamped from again, so they keep
+    //sharing its storage
+    std::map<int,int> source;
+
+    SiteTerms delta;
+    for(int j = 1; j <= N; ++j)
+        {
+        delta.clear();
+        for(int type = 1; type <= 2; ++type)
+            {
+            const int r = (type == 1 ? ko1+1 : 2*ko1+koXY+1);
+            addRungTerms(delta,type,builtXY_,-1,j,r,ds,k);
+            addRungTerms(delta,type,fitXY_,1,j,r,ds,k);
+            }
+        delta.compact();
+
+        if(!tables_.empty())
+            {
+            SiteTerms& t = tables_.at(j);
+            for(size_t n = 0; n < delta.terms().size(); ++n)
+                {
+                const SiteTerms::Term& d = delta.terms()[n];
+                t.add(d.row,d.col,d.op,d.coef);
+                }
+            t.compact();
+            }
+
+        if(QH.isNull()) continue;
+
+        const int j0 = (proto_.empty() ? 0 : proto_.at(j));
+        if(j0 > 0 && j != 1 && j != N)
+            {
+            std::map<int,int>::const_iterator s = source.find(j0);
+            if(s != source.end())
+                {
+                copySite(s->second,j,iqlinks_);
+                continue;
+                }
+            source[j0] = j;
+            }
+
+        IQIndex row = conj(iqlinks_.at(j-1)),
+                col = iqlinks_.at(j);
+        IQTensor dW(conj(model.si(j)),model.siP(j),row,col);
+        delta.addTo(dW,model,j,row,col);
+
+        if(j == 1)
+            {
+            std::vector<Index> start_inds(1,q0_.at(0));
+            dW = makeLedge(iqlinks_.at(0),start_inds) * dW;
+            }
+        if(j == N)
+            {
+            std::vector<Index> end_inds(1,q0_.at(N));
+            dW = dW * makeRedge(conj(iqlinks_.at(N)),end_inds);
+            }
+        QH.AAnc(j) += dW;
+        }
+    builtXY_ = fitXY_;
+
+    if(!S_.isNull())
+        S_ = SparseMPO(model,tables_,k,ds);
+    if(!H.isNull())
+        denseMPO(model,tables_,std::vector<int>(N+1,k),k,ds,H);
+
+    return true;
+    }
+
 void inline
 HTerms(const SpinHalf& model,
        Real LambdaXY, Real LambdaZ, std::vector<IQMPO>& terms,
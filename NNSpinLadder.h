@@ -3,6 +3,8 @@
 #include "hams.h"
 #include "fitting.h"
 #include "hambuilder.h"
+#include "siteterms.h"
+#include "sparsempo.h"
 
 class NNSpinLadder : public MPOBuilder
     {
@@ -18,6 +20,13 @@ class NNSpinLadder : public MPOBuilder
 
     operator const IQMPO&() { init(); return H; }
 
+    //Just the term tables, for dmrg with a LocalSparseMPO
+    operator const SparseMPO&() 
+        { 
+        if(S_.isNull()) build(true); 
+        return S_; 
+        }
+
     private:
 
     /////////////
@@ -28,14 +37,18 @@ class NNSpinLadder : public MPOBuilder
          LambdaXY_;
 
     IQMPO H;
+    SparseMPO S_;
 
     //
     /////////////
 
     void
-    init()
+    init() { build(false); }
+
+    void
+    build(bool sparse)
         {
-        H = IQMPO(model);
+        if(!sparse) H = IQMPO(model);
         const int N = model.NN();
 
 
@@ -70,47 +83,64 @@ class NNSpinLadder : public MPOBuilder
         std::vector<Index> end_inds(1); 
         end_inds[0] = q0.at(N);
 
+        SiteTerms terms;
+        std::vector<SiteTerms> tables(sparse ? N+1 : 0);
         for(int j = 1; j <= N; ++j)
             {
-            //Create j^th A (an IQTensor)
-            IQTensor &W = H.AAnc(j);
             IQIndex row = conj(iqlinks.at(j-1)),
                     col = iqlinks.at(j);
 
             int leg = (j%2==1 ? 1 : 2);
 
-            W = IQTensor(conj(model.si(j)),model.siP(j),row,col);
+            terms.clear();
 
             //Identity string operators
-            W += model.id(j) * row(ds) * col(ds);
-            W += model.id(j) * row(k) * col(k);
+            terms.add(ds,ds,SiteTerms::Id);
+            terms.add(k,k,SiteTerms::Id);
 
             //S+ S- terms
             if(leg == 1)
                 {
-                W += model.sp(j) * row(k) * col(1) * (LambdaXY_/2.);
+                terms.add(k,1,SiteTerms::Sp,LambdaXY_/2.);
                 }
-            W += model.sp(j) * row(k) * col(2) * 0.5;
-            W += model.id(j) * row(2) * col(1);
-            W += model.sm(j) * row(1) * col(ds);
+            terms.add(k,2,SiteTerms::Sp,0.5);
+            terms.add(2,1,SiteTerms::Id);
+            terms.add(1,ds,SiteTerms::Sm);
 
             //S- S+ terms
             if(leg == 1)
                 {
-                W += model.sm(j) * row(k) * col(3) * (LambdaXY_/2.);
+                terms.add(k,3,SiteTerms::Sm,LambdaXY_/2.);
                 }
-            W += model.sm(j) * row(k) * col(4) * 0.5;
-            W += model.id(j) * row(4) * col(3);
-            W += model.sp(j) * row(3) * col(ds);
+            terms.add(k,4,SiteTerms::Sm,0.5);
+            terms.add(4,3,SiteTerms::Id);
+            terms.add(3,ds,SiteTerms::Sp);
 
             //Sz Sz terms
             if(leg == 1)
                 {
-                W += model.sz(j) * row(k) * col(6) * LambdaZ_;
+                terms.add(k,6,SiteTerms::Sz,LambdaZ_);
                 }
-            W += model.sz(j) * row(k) * col(7);
-            W += model.id(j) * row(7) * col(6);
-            W += model.sz(j) * row(6) * col(ds);
+            terms.add(k,7,SiteTerms::Sz);
+            terms.add(7,6,SiteTerms::Id);
+            terms.add(6,ds,SiteTerms::Sz);
+
+            if(sparse)
+                {
+                tables.at(j) = terms;
+                continue;
+                }
+
+            //Create j^th A (an IQTensor)
+            IQTensor &W = H.AAnc(j);
+            W = IQTensor(conj(model.si(j)),model.siP(j),row,col);
+            terms.addTo(W,model,j,row,col);
+            }
+
+        if(sparse)
+            {
+            S_ = SparseMPO(model,tables,k,ds);
+            return;
             }
 
         H.AAnc(1) = makeLedge(iqlinks.at(0),start_inds) * H.AA(1);
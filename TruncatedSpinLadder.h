@@ -0,0 +1,224 @@
+#ifndef __TRUNCATEDSPINLADDER_H
+#define __TRUNCATEDSPINLADDER_H
+#include "hams.h"
+#include "hambuilder.h"
+#include "siteterms.h"
+#include "sparsempo.h"
+
+#define Cout std::cout
+#define Endl std::endl
+#define Format boost::format
+
+//
+// The exact ladder Hamiltonian of HTerms, 1/d^3 along the
+// legs (d <= cutoff+1) and the interleg couplings for rung
+// distance d <= cutoff, as one finite state machine MPO
+// instead of a sum of one MPO per pair. A channel of each
+// operator type (S+, S-, Sz) counts the sites m since its
+// start operator, so the term ending on site j from channel
+// m is the pair (j-m,j); with D = 2*cutoff+2 the largest
+// site distance, k = 3*D+2. A negative cutoff keeps every
+// pair (D = N-1).
+//
+class TruncatedSpinLadder : public MPOBuilder
+    {
+    public:
+
+    TruncatedSpinLadder(const Model& model_, Real LambdaXY, Real LambdaZ, int cutoff,
+                        const Option& opt1 = Option(), const Option& opt2 = Option())
+        :
+        MPOBuilder(model_),
+        initted_(false),
+        LambdaXY_(LambdaXY),
+        LambdaZ_(LambdaZ),
+        cutoff_(cutoff)
+        {
+        OptionSet oset(opt1,opt2);
+        pin_ = oset.realOrDefault("Pinning",0);
+        stagger_pinning_ = oset.boolOrDefault("StaggerPinning",false);
+
+        const int N = model.NN();
+        D_ = (cutoff_ < 0 ? N-1 : min(2*cutoff_+2,N-1));
+        }
+
+    operator const IQMPO&() { init(); return QH; }
+
+    //Built straight from the term tables, without an IQMPO
+    operator const MPO&()
+        {
+        if(H.isNull()) build(false,true);
+        return H;
+        }
+
+    //Just the term tables, for dmrg with a LocalSparseMPO
+    operator const SparseMPO&()
+        {
+        if(S_.isNull()) build(true,false);
+        return S_;
+        }
+
+    int
+    bondDimension() const { return 3*D_+2; }
+
+    private:
+
+    /////////////
+    //
+    // Data Members
+
+    bool initted_;
+
+    Real LambdaXY_,
+         LambdaZ_;
+    int cutoff_,
+        D_;
+
+    Real pin_;
+    bool stagger_pinning_;
+
+    IQMPO QH;
+    MPO H;
+    SparseMPO S_;
+
+    //
+    /////////////
+
+    //XY and Z couplings of sites i < j, zero beyond the cutoff
+    void
+    couplings(int i, int j, Real& jxy, Real& jz) const
+        {
+        jxy = jz = 0;
+        const int xi = (i+1)/2,
+                  xj = (j+1)/2;
+        if(i%2 == j%2)
+            {
+            const int d = xj-xi;
+            if(cutoff_ >= 0 && d > cutoff_+1) return;
+            jxy = jz = 1./pow(d,3);
+            }
+        else
+            {
+            const Real d = fabs(1.*(xj-xi));
+            if(cutoff_ >= 0 && d > cutoff_) return;
+            const Real r2 = d*d+1;
+            jxy = 1./pow(r2,1.5)*(1-(1-LambdaXY_)/r2);
+            jz = 1./pow(r2,1.5)*(1-(1-LambdaZ_)/r2);
+            }
+        }
+
+    void
+    init()
+        {
+        if(initted_) return;
+        build(false,false);
+        initted_ = true;
+        }
+
+    void
+    build(bool sparse, bool dense)
+        {
+        const int N = model.NN();
+
+        //S+ channels 1..D (QN -2), S- D+1..2D (QN +2),
+        //then ds, Sz 2D+2..3D+1 and k (QN 0)
+        const int D = D_,
+                  ds = 2*D+1,
+                  k = 3*D+2;
+
+        Cout << Format("Truncated range MPO: cutoff %d, k = %d") % cutoff_ % k << Endl;
+
+        std::vector<IQIndex> iqlinks(N+1);
+        std::vector<Index> q0(N+1),
+                           qP(N+1),
+                           qM(N+1);
+        for(int i = 0; i <= N; ++i)
+            {
+            qP.at(i) = Index(nameint("qP_",i),D);
+            qM.at(i) = Index(nameint("qM_",i),D);
+            q0.at(i) = Index(nameint("q0_",i),D+2);
+
+            iqlinks.at(i) = IQIndex(nameint("hl",i),
+                                    qP[i],QN(-2),
+                                    qM[i],QN(+2),
+                                    q0[i],QN( 0));
+            }
+
+        const bool keep = (sparse || dense);
+        if(!keep) QH = IQMPO(model);
+
+        SiteTerms terms;
+        std::vector<SiteTerms> tables(keep ? N+1 : 0);
+        for(int j = 1; j <= N; ++j)
+            {
+            terms.clear();
+
+            //Identity string operators
+            terms.add(ds,ds,SiteTerms::Id);
+            terms.add(k,k,SiteTerms::Id);
+
+            if(j < 3 && pin_ != 0)
+                {
+                const Real pval = (stagger_pinning_ && j%2 == 0 ? -pin_ : pin_);
+                terms.add(k,ds,SiteTerms::Sx,pval);
+                }
+
+            for(int type = 1; type <= 3; ++type)
+                {
+                const int base = (type == 1 ? 0 : (type == 2 ? D : ds));
+                const SiteTerms::OpType start_op = (type == 1 ? SiteTerms::Sp : (type == 2 ? SiteTerms::Sm : SiteTerms::Sz)),
+                                        end_op = (type == 1 ? SiteTerms::Sm : (type == 2 ? SiteTerms::Sp : SiteTerms::Sz));
+
+                terms.add(k,base+1,start_op,(type == 3 ? 1 : 0.5));
+
+                for(int m = 1; m < D; ++m)
+                    terms.add(base+m,base+m+1,SiteTerms::Id);
+
+                for(int m = 1; m <= D && j-m >= 1; ++m)
+                    {
+                    Real jxy = 0, jz = 0;
+                    couplings(j-m,j,jxy,jz);
+                    terms.add(base+m,ds,end_op,(type == 3 ? jz : jxy));
+                    }
+                }
+
+            if(keep)
+                {
+                tables.at(j) = terms;
+                continue;
+                }
+
+            IQIndex row = conj(iqlinks.at(j-1)),
+                    col = iqlinks.at(j);
+            IQTensor &W = QH.AAnc(j);
+            W = IQTensor(conj(model.si(j)),model.siP(j),row,col);
+            terms.addTo(W,model,j,row,col);
+            }
+
+        if(sparse)
+            {
+            S_ = SparseMPO(model,tables,k,ds);
+            return;
+            }
+        if(dense)
+            {
+            denseMPO(model,tables,std::vector<int>(N+1,k),k,ds,H);
+            return;
+            }
+
+        std::vector<Index> start_inds(1);
+        start_inds[0] = q0.at(0);
+
+        std::vector<Index> end_inds(1);
+        end_inds[0] = q0.at(N);
+
+        QH.AAnc(1) = makeLedge(iqlinks.at(0),start_inds) * QH.AA(1);
+        QH.AAnc(N) = QH.AA(N) * makeRedge(conj(iqlinks.at(N)),end_inds);
+        }
+
+    };
+
+#undef Cout
+#undef Endl
+#undef Format
+
+#endif
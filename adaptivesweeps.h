@@ -0,0 +1,141 @@
+#ifndef __ADAPTIVESWEEPS_H
+#define __ADAPTIVESWEEPS_H
+#include "Sweeps.h"
+#include <vector>
+
+#define Cout std::cout
+#define Endl std::endl
+#define Format boost::format
+
+//
+// Chooses maxm, cutoff, Davidson iterations and noise of
+// the sweeps still to come from how the last one went,
+// instead of following a fixed Sweeps table, and says when
+// to stop. The run is done once the energy changed by less
+// than energy_tol, the largest truncation error is below
+// trunc_tol (or maxm can't usefully grow any more) and,
+// with es_tol > 0, the entanglement splitting changed by
+// less than es_tol.
+//
+// maxm is raised by the factor growth, up to max_m, only
+// while the truncation error is above trunc_tol with every
+// state kept that maxm allows, and stops growing once a
+// raise lowered the energy by less than energy_tol: more
+// states no longer pay off. Until the energy changes by
+// less than 100*energy_tol, the Davidson solver gets more
+// iterations and the table's noise is kept; after that
+// the noise is switched off. The table's own noise and
+// niter are remembered at the first update, so a sweep
+// can go back to them after they were overwritten.
+//
+// update rewrites the Sweeps it is given, so every dmrg
+// run needs its own copy of the table.
+//
+class AdaptiveSweeps
+    {
+    public:
+
+    AdaptiveSweeps(Real energy_tol, Real trunc_tol, Real es_tol,
+                   int max_m, Real growth = 1.5)
+        :
+        energy_tol_(energy_tol),
+        trunc_tol_(trunc_tol),
+        es_tol_(es_tol),
+        max_m_(max_m),
+        growth_(growth),
+        nsweep_(0),
+        last_energy_(0),
+        grew_(false),
+        saturated_(false)
+        { }
+
+    //
+    // Call after sweep sw with its energy, largest
+    // truncation error and kept m and the change of the
+    // entanglement splitting; sets sweeps sw+1, sw+2, ...
+    // Returns true when every criterion is met.
+    //
+    bool
+    update(Sweeps& sweeps, int sw, Real energy, Real truncerr, int m, Real des);
+
+    private:
+
+    Real energy_tol_,
+         trunc_tol_,
+         es_tol_;
+    int max_m_;
+    Real growth_;
+
+    int nsweep_;
+    Real last_energy_;
+    bool grew_,
+         saturated_;
+
+    //Noise and niter of the table, by sweep
+    std::vector<Real> noise_;
+    std::vector<int> niter_;
+
+    };
+
+bool inline AdaptiveSweeps::
+update(Sweeps& sweeps, int sw, Real energy, Real truncerr, int m, Real des)
+    {
+    if(nsweep_ == 0)
+        {
+        noise_.assign(sweeps.nsweep()+1,0);
+        niter_.assign(sweeps.nsweep()+1,0);
+        for(int s = 1; s <= sweeps.nsweep(); ++s)
+            {
+            noise_[s] = sweeps.noise(s);
+            niter_[s] = sweeps.niter(s);
+            }
+        }
+
+    const Real dE = (nsweep_ > 0 ? fabs(energy-last_energy_) : -1);
+    last_energy_ = energy;
+    ++nsweep_;
+
+    //A raise of maxm in the last sweep that gained less than
+    //energy_tol means more states no longer pay off
+    if(grew_ && dE >= 0 && dE < energy_tol_) saturated_ = true;
+
+    int maxm = sweeps.maxm(sw);
+
+    const bool energy_done = (dE >= 0 && dE < energy_tol_),
+               trunc_done = (truncerr <= trunc_tol_ || saturated_ || maxm >= max_m_),
+               es_done = (es_tol_ <= 0 || des < es_tol_);
+    if(energy_done && trunc_done && es_done)
+        {
+        Cout << Format("\nAdaptive sweeps converged: dE = %.2E, truncation error = %.2E")
+                % dE % truncerr << Endl;
+        return true;
+        }
+
+    grew_ = false;
+    if(truncerr > trunc_tol_ && m >= maxm && !saturated_ && maxm < max_m_)
+        {
+        maxm = std::min(max_m_,int(ceil(growth_*maxm)));
+        grew_ = true;
+        }
+
+    const bool rough = (dE < 0 || dE > 100*energy_tol_);
+
+    for(int s = sw+1; s <= sweeps.nsweep(); ++s)
+        {
+        sweeps.setMaxm(s,maxm);
+        sweeps.setCutoff(s,std::min(sweeps.cutoff(s),trunc_tol_));
+        sweeps.setNiter(s,rough ? std::max(niter_.at(s),4) : std::min(niter_.at(s),2));
+        sweeps.setNoise(s,rough ? noise_.at(s) : 0);
+        }
+
+    if(sw < sweeps.nsweep())
+        Cout << Format("Adaptive sweeps: next maxm = %d%s, niter = %d, noise = %.1E")
+                % maxm % (saturated_ ? " (saturated)" : "") % sweeps.niter(sw+1) % sweeps.noise(sw+1) << Endl;
+    return false;
+    }
+
+#undef Cout
+#undef Endl
+#undef Format
+
+#endif
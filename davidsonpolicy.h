@@ -0,0 +1,41 @@
+#ifndef __DAVIDSONPOLICY_H
+#define __DAVIDSONPOLICY_H
+
+//
+// How many Davidson iterations a bond needs: solving the
+// local problem much more precisely than the truncation
+// that follows only wastes H*phi products. The local state
+// starts out about as wrong as the energy changed over the
+// last sweep, dE, and each iteration is taken to reduce the
+// error by the factor rate, so reaching the truncation
+// error takes about log(truncerr/dE)/log(rate) iterations.
+// Without a dE yet (first sweep) the full budget is used.
+//
+class DavidsonPolicy
+    {
+    public:
+
+    DavidsonPolicy(Real rate = 0.1, int min_niter = 1)
+        :
+        rate_(rate),
+        min_niter_(min_niter)
+        { }
+
+    int
+    niter(Real truncerr, Real dE, int max_niter) const
+        {
+        if(dE <= 0 || max_niter <= min_niter_) return max_niter;
+        const Real target = std::max(truncerr,1E-14);
+        if(target >= dE) return min_niter_;
+        const int n = 1+int(ceil(log(target/dE)/log(rate_)));
+        return std::max(min_niter_,std::min(max_niter,n));
+        }
+
+    private:
+
+    Real rate_;
+    int min_niter_;
+
+    };
+
+#endif
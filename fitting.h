@@ -2,6 +2,7 @@
 #define __FITTING_H
 
 #include "itensor.h"
+#include <vector>
 
 Vector inline
 fabs(const Vector& v) 
@@ -46,6 +47,34 @@ PseudoInverse(const Matrix& M, Matrix& Minv, Real cutoff = 0)
     Minv = V.t()*Lambda*U.t();
     }
 
+//
+// Adds row h to the n x n upper triangular factor R
+// of a QR decomposition, using Givens rotations, so
+// a tall matrix can be factored without storing it.
+// h is overwritten.
+//
+void inline
+qrAddRow(Matrix& R, Vector& h)
+    {
+    const int n = R.Ncols();
+    for(int i = 0; i < n; ++i)
+        {
+        const Real b = h.el(i);
+        if(b == 0) continue;
+        const Real a = R.el(i,i),
+                   rr = sqrt(a*a+b*b),
+                   c = a/rr,
+                   s = b/rr;
+        for(int j = i; j < n; ++j)
+            {
+            const Real rj = R.el(i,j), 
+                       hj = h.el(j);
+            R.el(i,j) = c*rj + s*hj;
+            h.el(j) = c*hj - s*rj;
+            }
+        }
+    }
+
 class Cplx
     {
 public:
@@ -79,6 +108,33 @@ public:
     };
 
 
+Option inline
+FitTolerance(Real val)
+    {
+    return Option("FitTolerance",val);
+    }
+
+Option inline
+RelativeTolerance(bool val = true)
+    {
+    return Option("RelativeTolerance",val);
+    }
+
+Option inline
+RefineFit(bool val = true)
+    {
+    return Option("RefineFit",val);
+    }
+
+//Memory O(nexp^2) instead of O(N nexp), for very
+//long systems; the default for N > 10000
+Option inline
+StreamingFit(bool val = true)
+    {
+    return Option("StreamingFit",val);
+    }
+
+
 class Callable
     {
     public:
@@ -88,11 +144,19 @@ class Callable
     Real 
     operator()(Real x) const { return call(x); }
 
+    //Identifies the function and its parameters,
+    //used to cache fits; empty if it can't be cached
+    std::string
+    key() const { return getKey(); }
+
     private:
 
     Real virtual
     call(Real x) const = 0;
 
+    std::string virtual
+    getKey() const { return ""; }
+
     };
 
 
@@ -103,16 +167,43 @@ class ExpFit
 
     ExpFit();
 
-    ExpFit(const Callable& f, int N, int nexp,
-           const Option& opt1 = Option(), const Option& opt2 = Option());
+    //f can be any type with Real operator()(Real) const;
+    //passing a Callable goes through its virtual call()
+    template<class Function>
+    ExpFit(const Function& f, int N, int nexp,
+           const Option& opt1 = Option(), const Option& opt2 = Option(),
+           const Option& opt3 = Option(), const Option& opt4 = Option());
+
+    //Only tabulates f, for use with fitJointly
+    template<class Function>
+    ExpFit(const Function& f, int N);
+
+    //Refits all of fits with one shared set of lambdas
+    //and separate weights, choosing nexp as the Auto or
+    //FitTolerance options say (fixed nexp otherwise).
+    //Every fit must have been made with the same N.
+    static void
+    fitJointly(std::vector<ExpFit*>& fits, int nexp,
+               const Option& opt1 = Option(), const Option& opt2 = Option(),
+               const Option& opt3 = Option(), const Option& opt4 = Option());
 
     Real
     operator()(int d) const;
 
+    //Fitted values for d = 1,2,...,n (n = Nb by default)
+    //in one pass; prefer this to operator() in loops over d
+    void
+    evaluate(Vector& res, int n = -1) const;
+
     void
     stats(bool& lambda_is_real, Real& maxdiff, 
           int& maxdiff_pos, Real& avgdiff) const;
 
+    //Largest deviation from f over d=1..Nb,
+    //divided by |f(d)| if relative is true
+    Real
+    maxDiff(bool relative = false) const;
+
     const Vector&
     ReLambda() const { return ReLambda_; }
     const Vector&
@@ -126,14 +217,51 @@ class ExpFit
     int
     nexp() const { return nexp_; }
 
+    //Tabulates the function being fit at d = 1..Nb,
+    //the only values the fit ever uses; needs to be
+    //called again after reading a fit from disk
+    template<class Function>
+    void
+    callable(const Function& f);
+
+    void
+    read(std::istream& s);
+    void
+    write(std::ostream& s) const;
+
+    //Exponentials with complex weights are laid out
+    //as 2x2 blocks by the MPO builders
+    bool
+    isComplex(int k) const { return fabs(ImChi_(k)) > 1E-15; }
+
+    //Number of MPO channels (per operator type and leg)
+    //needed for this fit: complex exponentials count twice
+    int
+    nchannel() const;
+
+    //Channels needed by fits sharing their lambdas when
+    //they use the same channels: an exponential counts
+    //twice if it is complex in any of them
+    static int
+    nchannel(const std::vector<ExpFit*>& fits);
+
+    //True if other has exactly the same lambdas,
+    //as fits made by fitJointly do
+    bool
+    sharesLambdas(const ExpFit& other) const;
+
+    //Warnings from making and evaluating the fit, kept
+    //instead of printed so fits can be made on several
+    //threads; the first few of each kind are kept
+    const std::string&
+    warnings() const { return warnings_; }
+
     private:
 
     ///////////////////
     //
     // Data Members
     
-    const Callable* f_;
-    
     int N_,
         Nb_,
         nexp_;
@@ -143,65 +271,646 @@ class ExpFit
            ReChi_,
            ImChi_;
 
+    //f(d) for d = 1..Nb
+    Vector fv_;
+
+    mutable std::string warnings_;
+    mutable int nimag_;
+
     //
     //////////////////
 
+    void
+    setup(int nexp, const OptionSet& oset);
+
     void
     init();
 
+    static void
+    scan(std::vector<ExpFit*>& fits, int maxn, const OptionSet& oset);
+
+    static bool
+    refine(std::vector<ExpFit*>& fits, bool relative, int maxiter = 200);
+
+    //StreamingFit is on by default for long systems
+    static bool
+    useStreaming(const OptionSet& oset, int Nb) 
+        { return oset.boolOrDefault("StreamingFit",Nb > 10000); }
+
+    static Real
+    refineCost(const std::vector<ExpFit*>& fits, const std::vector<Vector>& wt,
+               const std::vector<int>& off, const std::vector<int>& pair,
+               const Vector& x, Matrix* A, Vector* g,
+               std::vector<int>& act, std::vector<Real>& jrow);
+
+    void
+    warnImag(Real im) const;
+
+    void
+    fitWeights();
+
+    void
+    fitWeightsNormal(const Vector& fv);
+
+    Real
+    fitDiff(const Vector& fv, bool relative) const;
+
     };
 
 inline ExpFit::
 ExpFit()
     :
-    f_(0),
     N_(0),
     Nb_(0),
-    nexp_(0)
+    nexp_(0),
+    nimag_(0)
     { }
 
+template<class Function>
 inline ExpFit::
-ExpFit(const Callable& f,int N, int nexp,
-       const Option& opt1, const Option& opt2)
+ExpFit(const Function& f,int N, int nexp,
+       const Option& opt1, const Option& opt2,
+       const Option& opt3, const Option& opt4)
     :
-    f_(&f),
     N_(N),
     Nb_(N-1),
-    nexp_(nexp)
+    nexp_(nexp),
+    nimag_(0)
     { 
-    OptionSet oset(opt1,opt2);
+    callable(f);
+    setup(nexp,OptionSet(opt1,opt2,opt3,opt4));
+    }
 
+template<class Function>
+void inline ExpFit::
+callable(const Function& f)
+    {
+    fv_.ReDimension(Nb_);
+    for(int d = 1; d <= Nb_; ++d) 
+        fv_(d) = f(d);
+    }
+
+void inline ExpFit::
+setup(int nexp, const OptionSet& oset)
+    {
     //
-    // Do automatic fit if requested
+    // Do automatic fit if requested: either the
+    // most accurate one (Auto) or the cheapest one
+    // within an error budget (FitTolerance). The
+    // scan also does fixed nexp fits for StreamingFit,
+    // which init doesn't support
     //
-    if(oset.defined("Auto"))
+    if(oset.defined("FitTolerance") || oset.defined("Auto")
+       || useStreaming(oset,Nb_))
+        {
+        std::vector<ExpFit*> fits(1,this);
+        scan(fits,nexp,oset);
+        return;
+        }
+
+    init();
+
+    if(oset.boolOrDefault("RefineFit",false))
+        {
+        std::vector<ExpFit*> fits(1,this);
+        refine(fits,oset.boolOrDefault("RelativeTolerance",false));
+        }
+    }
+
+//
+// Tries every nexp up to maxn using a single SVD
+// of the (Nb-maxn+1) x maxn Hankel matrix of f.
+// The order-n shift-invariance problem only involves
+// the n leading left singular vectors U_n:
+//
+//   Meff_n = (Q1^T Q1)^{-1} Q1^T Q2 = (1 + w w^T/(1-|w|^2)) G_n
+//
+// where G = Q1^T Q2 is computed once and w is the
+// last row of U_n, so each order costs O(n^2) plus
+// a small eigenproblem. Weights for each candidate
+// come from the normal equations; the chosen fit gets
+// a final pseudo-inverse least squares solve, kept only
+// if it is no less accurate.
+//
+// Given several fits, their Hankel matrices are placed
+// side by side so U spans the decays of all of them:
+// the lambdas are shared and each fit gets its own
+// weights, with the error and channel count of a
+// candidate taken over all fits together.
+//
+// With StreamingFit the Hankel matrix is never formed:
+// its rows go through a QR one at a time and the right
+// singular vectors of the small factor R (which are
+// shift-invariant as well, the Hankel matrix being
+// Vandermonde on both sides) take the place of U.
+//
+// With RefineFit, a candidate missing the tolerance
+// is refined (see refine) before trying more
+// exponentials; without a tolerance only the chosen
+// fit is refined.
+//
+void inline ExpFit::
+scan(std::vector<ExpFit*>& fits, int maxn, const OptionSet& oset)
+    {
+    const bool use_tol = oset.defined("FitTolerance");
+    const Real tol = oset.realOrDefault("FitTolerance",0);
+    const bool relative = oset.boolOrDefault("RelativeTolerance",false);
+    const bool quiet = oset.boolOrDefault("Quiet",false);
+    const bool fixed = !use_tol && !oset.defined("Auto");
+    const bool do_refine = oset.boolOrDefault("RefineFit",false);
+
+    const int nf = fits.size();
+    const int Nb = fits.front()->Nb_;
+    for(int f = 1; f < nf; ++f)
+        if(fits[f]->Nb_ != Nb) Error("ExpFit: fits done jointly must have the same N");
+
+    const bool streaming = useStreaming(oset,Nb);
+
+    const int nmin = (fixed ? maxn : (use_tol ? 1 : 2));
+
+    //Q1 below must keep at least as many rows as columns;
+    //the streaming path reads lambdas off the right singular
+    //vectors, so it needs one column more than nexp
+    const int P = (streaming ? min(maxn+1,Nb/2) : min(min(Nb-2,maxn),Nb/2)),
+              nmax = (streaming ? P-1 : P);
+    if(nmax < nmin && (nf == 1 || nmax < 1))
+        {
+        if(nf > 1) Error("ExpFit: too few sites for a joint fit");
+        fits.front()->nexp_ = min(nmin,Nb);
+        fits.front()->init();
+        return;
+        }
+
+    const int m = Nb-P+1;
+
+    //Orthonormal basis B of the shift-invariant subspace
+    Matrix B;
+    if(streaming)
+        {
+        //Hankel matrices stacked vertically (the shift acts
+        //on their columns), fed row by row into a QR so only
+        //the P x P factor R is ever stored; H = Q R shares
+        //its right singular vectors with R
+        Matrix R(P,P); R = 0;
+        Vector h(P);
+        for(int f = 0; f < nf; ++f)
+            {
+            const Vector& fv = fits[f]->fv_;
+            for(int j = 1; j <= m; ++j)
+                {
+                for(int i = 1; i <= P; ++i) 
+                    h(i) = fv(i+j-1);
+                qrAddRow(R,h);
+                }
+            }
+        Matrix U,V;
+        Vector D;
+        SVD(R,U,D,V);
+        B = V.t();
+        }
+    else
+        {
+        Matrix M(m,nf*P);
+        for(int f = 0; f < nf; ++f)
+            {
+            const Vector& fv = fits[f]->fv_;
+            for(int i = 1; i <= P; ++i)
+            for(int j = 1; j <= m; ++j)
+                {
+                M(j,f*P+i) = fv(i+j-1);
+                }
+            }
+
+        Matrix V;
+        Vector D;
+        SVD(M,B,D,V);
+        }
+    const int mb = B.Nrows(),
+              r = min(min(maxn,B.Ncols()),mb-1);
+
+    Matrix G = B.SubMatrix(1,mb-1,1,r).t() * B.SubMatrix(2,mb,1,r);
+
+    //Candidates are kept whole since refined
+    //weights can't be recomputed from the lambdas
+    int best_nexp = -1,
+        best_nchan = 100000;
+    Real best_maxdiff = 0;
+    bool best_refined = false;
+    std::vector<ExpFit> best;
+
+    Real min_maxdiff = 1E10;
+    int fallback_nexp = -1;
+    bool fallback_refined = false;
+    std::vector<ExpFit> fallback;
+
+    Vector lre, lim;
+
+    Real wsq = 0;
+    for(int n = 1; n <= r; ++n)
+        {
+        wsq += B(mb,n)*B(mb,n);
+
+        if(n < nmin) continue;
+
+        //Each exponential costs at least one channel
+        if(use_tol && n >= best_nchan) break;
+
+        //Q1 no longer has full column rank
+        if(wsq > 1-1E-12) break;
+
+        Matrix Meff = G.SubMatrix(1,n,1,n);
+        for(int k = 1; k <= n; ++k)
+            {
+            Real wG = 0;
+            for(int i = 1; i <= n; ++i) 
+                wG += B(mb,i)*G(i,k);
+            wG /= (1-wsq);
+            for(int i = 1; i <= n; ++i) 
+                Meff(i,k) += B(mb,i)*wG;
+            }
+
+        GenEigenValues(Meff,lre,lim);
+
+        //Growing exponentials blow up over long systems
+        bool stable = true;
+        for(int k = 1; k <= n; ++k)
+            if(lre(k)*lre(k)+lim(k)*lim(k) >= 1) stable = false;
+        if(!stable) continue;
+
+        Real maxdiff = 0;
+        for(int f = 0; f < nf; ++f)
+            {
+            ExpFit& ef = *fits[f];
+            ef.warnings_.clear();
+            ef.nimag_ = 0;
+            ef.nexp_ = n;
+            ef.ReLambda_ = lre;
+            ef.ImLambda_ = lim;
+            ef.fitWeightsNormal(ef.fv_);
+            maxdiff = max(maxdiff,ef.fitDiff(ef.fv_,relative));
+            }
+
+        //Give a candidate missing the tolerance a chance
+        //to meet it before trying more exponentials
+        bool refined = false;
+        if(do_refine && use_tol && maxdiff > tol)
+            {
+            refined = refine(fits,relative);
+            if(refined)
+                {
+                maxdiff = 0;
+                for(int f = 0; f < nf; ++f)
+                    maxdiff = max(maxdiff,fits[f]->fitDiff(fits[f]->fv_,relative));
+                }
+            }
+
+        const int nchan = nchannel(fits);
+        if(!quiet)
+            std::cout << "Trying nexp = " << n << ", nchannel = " << nchan 
+                      << ", maxdiff = " << maxdiff << (refined ? " (refined)" : "") << std::endl;
+
+        if(use_tol && maxdiff <= tol && nchan < best_nchan)
+            {
+            best_nchan = nchan;
+            best_nexp = n;
+            best_maxdiff = maxdiff;
+            best_refined = refined;
+            best.clear();
+            for(int f = 0; f < nf; ++f) best.push_back(*fits[f]);
+            }
+        if(maxdiff < min_maxdiff)
+            {
+            min_maxdiff = maxdiff;
+            fallback_nexp = n;
+            fallback_refined = refined;
+            fallback.clear();
+            for(int f = 0; f < nf; ++f) fallback.push_back(*fits[f]);
+            }
+        }
+
+    if(best_nexp < 0)
+        {
+        if(fallback_nexp < 0)
+            {
+            if(nf > 1) Error("ExpFit: no usable joint fit");
+            fits.front()->nexp_ = nmin;
+            fits.front()->init();
+            return;
+            }
+        best_nexp = fallback_nexp;
+        best_maxdiff = min_maxdiff;
+        best_refined = fallback_refined;
+        best = fallback;
+        }
+
+    for(int f = 0; f < nf; ++f)
+        *fits[f] = best.at(f);
+
+    //The pseudo-inverse solve is usually a little more
+    //accurate than the normal equations but not always;
+    //keep the weights the candidate was chosen with unless
+    //it does at least as well, so the fit still meets tol
+    if(!best_refined)
+        {
+        Real maxdiff = 0;
+        for(int f = 0; f < nf; ++f)
+            {
+            fits[f]->fitWeights();
+            maxdiff = max(maxdiff,fits[f]->fitDiff(fits[f]->fv_,relative));
+            }
+        if(maxdiff > best_maxdiff)
+            {
+            for(int f = 0; f < nf; ++f)
+                *fits[f] = best.at(f);
+            }
+        }
+
+    if(do_refine && !best_refined && !use_tol)
+        refine(fits,relative);
+
+    if(use_tol && best_maxdiff > tol)
+        {
+        const std::string w = (boost::format("WARNING: no fit with nexp <= %d meets tolerance %.2E, best maxdiff = %.2E\n")
+                               % maxn % tol % best_maxdiff).str();
+        for(int f = 0; f < nf; ++f)
+            fits[f]->warnings_ += w;
+        }
+    }
+
+//
+// Levenberg-Marquardt refinement of the lambdas and
+// weights of fits sharing their lambdas, starting from
+// their current values. Minimizes the sum over fits and
+// d = 1..Nb of (fit(d)-f(d))^2, divided by f(d)^2 if
+// relative is true. A complex conjugate pair of
+// exponentials is one term 2 Re(chi lambda^d), so pairs
+// stay pairs; steps taking any |lambda| to 1 or more are
+// rejected. Returns false if the fits were left as is.
+//
+bool inline ExpFit::
+refine(std::vector<ExpFit*>& fits, bool relative, int maxiter)
+    {
+    const int nf = fits.size();
+    const ExpFit& f0 = *fits.front();
+    const int Nb = f0.Nb_;
+    const int ne = f0.nexp_;
+    if(ne <= 0) return false;
+
+    //Terms: first member of each exponential or conjugate pair
+    std::vector<int> term, 
+                     pair;
+    for(int k = 1; k <= ne; ++k)
+        {
+        const Real im = f0.ImLambda_(k);
+        if(im == 0) 
+            { 
+            term.push_back(k); 
+            pair.push_back(0); 
+            continue; 
+            }
+        if(im < 0) continue;
+        if(k == ne || f0.ReLambda_(k+1) != f0.ReLambda_(k) 
+                   || f0.ImLambda_(k+1) != -im) return false;
+        term.push_back(k);
+        pair.push_back(1);
+        }
+
+    //Parameters: lambdas, then the weights of each fit;
+    //a pair has two of each (re and im parts)
+    const int nt = term.size();
+    std::vector<int> off(nt+1,0);
+    for(int t = 0; t < nt; ++t) 
+        off[t+1] = off[t] + 1 + pair[t];
+    const int nl = off[nt],
+              np = nl*(1+nf);
+
+    Vector x(np);
+    for(int t = 0; t < nt; ++t)
+        {
+        const int k = term[t];
+        x.el(off[t]) = f0.ReLambda_(k);
+        if(pair[t]) x.el(off[t]+1) = f0.ImLambda_(k);
+        for(int f = 0; f < nf; ++f)
+            {
+            const int o = nl*(1+f)+off[t];
+            x.el(o) = fits[f]->ReChi_(k);
+            if(pair[t]) x.el(o+1) = fits[f]->ImChi_(k);
+            }
+        }
+
+    std::vector<Vector> wt(nf);
+    for(int f = 0; f < nf; ++f)
         {
-        bool lambda_is_real = true;
-        Real maxdiff = 100000.0;
-        int maxdiff_pos = -1;
-        Real avgdiff = 0;
+        const Vector& fv = fits[f]->fv_;
+        wt[f].ReDimension(Nb);
+        for(int d = 1; d <= Nb; ++d)
+            wt[f](d) = (relative && fv(d) != 0 ? 1./fabs(fv(d)) : 1.);
+        }
 
-        Real min_maxdiff = 10000.0;
-        int best_nexp = 2;
-        for(nexp_ = 2; nexp_ <= min(Nb_-2,nexp); ++nexp_)
+    std::vector<int> act(2*nl);
+    std::vector<Real> jrow(2*nl);
+
+    Matrix A(np,np);
+    Vector g(np);
+    Real cost = refineCost(fits,wt,off,pair,x,&A,&g,act,jrow);
+    const Real cost0 = cost;
+
+    Real mu = 1E-3;
+    Vector evals, step(np), xt(np);
+    Matrix evecs;
+    for(int iter = 1; iter <= maxiter; ++iter)
+        {
+        bool accepted = false;
+        while(mu < 1E12)
             {
-            init();
-            stats(lambda_is_real,maxdiff,maxdiff_pos,avgdiff);
-            if(!(oset.boolOrDefault("Quiet",false)))
-                std::cout << "Trying nexp = " << nexp_ << ", maxdiff = " << maxdiff << std::endl;
-            if(fabs(maxdiff) < min_maxdiff)
+            Matrix B(A);
+            for(int a = 0; a < np; ++a) 
+                B.el(a,a) += mu*(A.el(a,a) > 0 ? A.el(a,a) : 1);
+            EigenValues(B,evals,evecs);
+
+            step = 0;
+            for(int e = 1; e <= np; ++e)
                 {
-                min_maxdiff = maxdiff;
-                best_nexp = nexp_;
+                if(evals(e) <= 0) continue;
+                Real proj = 0;
+                for(int a = 1; a <= np; ++a) 
+                    proj += evecs(a,e)*g(a);
+                proj /= evals(e);
+                for(int a = 1; a <= np; ++a) 
+                    step(a) -= proj*evecs(a,e);
                 }
+            xt = x + step;
+
+            //Keep every |lambda| below 1
+            bool stable = true;
+            for(int t = 0; t < nt; ++t)
+                {
+                const Real lr = xt.el(off[t]),
+                           li = (pair[t] ? xt.el(off[t]+1) : 0);
+                if(lr*lr+li*li >= 1) stable = false;
+                }
+
+            if(stable)
+                {
+                const Real ct = refineCost(fits,wt,off,pair,xt,0,0,act,jrow);
+                if(ct < cost)
+                    {
+                    accepted = (cost-ct > 1E-12*cost);
+                    x = xt;
+                    cost = ct;
+                    mu = max(mu/3,1E-12);
+                    break;
+                    }
+                }
+            mu *= 4;
             }
+        if(!accepted) break;
+        refineCost(fits,wt,off,pair,x,&A,&g,act,jrow);
+        }
+
+    if(!(cost < cost0)) return false;
 
-        nexp_ = best_nexp;
+    for(int t = 0; t < nt; ++t)
+        {
+        const int k = term[t];
+        for(int f = 0; f < nf; ++f)
+            {
+            ExpFit& ef = *fits[f];
+            const int o = off[t],
+                      oc = nl*(1+f)+o;
+            ef.ReLambda_(k) = x.el(o);
+            ef.ImLambda_(k) = (pair[t] ? x.el(o+1) : 0);
+            ef.ReChi_(k) = x.el(oc);
+            ef.ImChi_(k) = (pair[t] ? x.el(oc+1) : 0);
+            if(pair[t])
+                {
+                ef.ReLambda_(k+1) = ef.ReLambda_(k);
+                ef.ImLambda_(k+1) = -ef.ImLambda_(k);
+                ef.ReChi_(k+1) = ef.ReChi_(k);
+                ef.ImChi_(k+1) = -ef.ImChi_(k);
+                }
+            }
+        }
+    return true;
+    }
+
+//
+// Weighted residual sum of squares for refine at
+// parameters x and, if A is non-null, the normal
+// equations A = J^T J, g = J^T r
+//
+Real inline ExpFit::
+refineCost(const std::vector<ExpFit*>& fits, const std::vector<Vector>& wt,
+           const std::vector<int>& off, const std::vector<int>& pair,
+           const Vector& x, Matrix* A, Vector* g,
+           std::vector<int>& act, std::vector<Real>& jrow)
+    {
+    const int nf = fits.size(),
+              nt = pair.size(),
+              nl = off[nt],
+              Nb = wt.front().Length();
+    if(A) { *A = 0; *g = 0; }
+    Real cost = 0;
+    for(int f = 0; f < nf; ++f)
+        {
+        const Vector& fv = fits[f]->fv_;
+        std::vector<Real> zr(nt,1), zi(nt,0);
+        for(int d = 1; d <= Nb; ++d)
+            {
+            Real val = 0;
+            int na = 0;
+            for(int t = 0; t < nt; ++t)
+                {
+                const int o = off[t],
+                          oc = nl*(1+f)+o;
+                const Real lr = x.el(o),
+                           li = (pair[t] ? x.el(o+1) : 0),
+                           cr = x.el(oc),
+                           ci = (pair[t] ? x.el(oc+1) : 0);
+                //z = lambda^(d-1) on entry
+                const Real pr = zr[t], pi = zi[t];
+                zr[t] = pr*lr - pi*li;
+                zi[t] = pr*li + pi*lr;
+                if(pair[t])
+                    {
+                    //2 Re(chi z) and its derivatives
+                    val += 2*(cr*zr[t] - ci*zi[t]);
+                    const Real dr = d*(cr*pr - ci*pi),
+                               di = d*(cr*pi + ci*pr);
+                    act[na] = o;    jrow[na++] = 2*dr;
+                    act[na] = o+1;  jrow[na++] = -2*di;
+                    act[na] = oc;   jrow[na++] = 2*zr[t];
+                    act[na] = oc+1; jrow[na++] = -2*zi[t];
+                    }
+                else
+                    {
+                    val += cr*zr[t];
+                    act[na] = o;  jrow[na++] = d*cr*pr;
+                    act[na] = oc; jrow[na++] = zr[t];
+                    }
+                }
+            const Real w = wt[f](d),
+                       r = w*(val-fv(d));
+            cost += r*r;
+            if(!A) continue;
+            for(int a = 0; a < na; ++a)
+                {
+                const Real ja = w*jrow[a];
+                g->el(act[a]) += ja*r;
+                for(int c = 0; c < na; ++c)
+                    A->el(act[a],act[c]) += ja*w*jrow[c];
+                }
+            }
         }
+    return cost;
+    }
 
+template<class Function>
+inline ExpFit::
+ExpFit(const Function& f, int N)
+    :
+    N_(N),
+    Nb_(N-1),
+    nexp_(0),
+    nimag_(0)
+    { 
+    callable(f);
     init();
     }
 
+void inline ExpFit::
+fitJointly(std::vector<ExpFit*>& fits, int nexp,
+           const Option& opt1, const Option& opt2,
+           const Option& opt3, const Option& opt4)
+    {
+    if(fits.empty()) return;
+    scan(fits,nexp,OptionSet(opt1,opt2,opt3,opt4));
+    }
+
+bool inline ExpFit::
+sharesLambdas(const ExpFit& other) const
+    {
+    if(nexp_ != other.nexp_) return false;
+    for(int k = 1; k <= nexp_; ++k)
+        {
+        if(ReLambda_(k) != other.ReLambda_(k) 
+           || ImLambda_(k) != other.ImLambda_(k)) return false;
+        }
+    return true;
+    }
+
+int inline ExpFit::
+nchannel(const std::vector<ExpFit*>& fits)
+    {
+    const ExpFit& f0 = *fits.front();
+    int res = f0.nexp_;
+    for(int k = 1; k <= f0.nexp_; ++k)
+        {
+        for(size_t f = 0; f < fits.size(); ++f)
+            if(fits[f]->isComplex(k)) { ++res; break; }
+        }
+    return res;
+    }
 
 void inline ExpFit::
 init()
@@ -227,7 +936,7 @@ init()
     for(int i = 0; i < nexp_; ++i)
     for(int j = 1; j <= Nb_-nexp_+1; ++j)
         {
-        M(j,i+1) = (*f_)(i+j);
+        M(j,i+1) = fv_(i+j);
         }
 
     int m = M.Nrows();
@@ -278,30 +987,59 @@ init()
 
     GenEigenValues(Meff,ReLambda_,ImLambda_);
 
-    //
-    // Do least squares fit to
-    // compute weights Chi
-    //
+    fitWeights();
+    }
+
+//
+// Do least squares fit to
+// compute weights Chi
+//
+//
+// Least squares problem L * chi = fv with rows of L
+// (re and im parts of lambda^i) made on the fly and
+// fed with fv(i) into a QR; the pseudo-inverse of the
+// small factor R then gives the same minimal norm
+// solution as that of L, which is never stored
+//
+void inline ExpFit::
+fitWeights()
+    {
+    const int nc = 2*nexp_;
+
+    Matrix R(nc+1,nc+1); R = 0;
+    Vector h(nc+1);
+
+    std::vector<Real> zr(nexp_),
+                      zi(nexp_);
+    for(int j = 0; j < nexp_; ++j)
+        {
+        zr[j] = ReLambda_(j+1);
+        zi[j] = ImLambda_(j+1);
+        }
 
-    //Set up least squares problem:
-    // L * chi = fv
-    Matrix L(Nb_,2*nexp_); L = 0;
-    Vector fv(Nb_); fv = 0;
     for(int i = 1; i <= Nb_; ++i)
         {
-        fv(i) = (*f_)(i);
-        for(int j = 1; j <= nexp_; ++j)
+        for(int j = 0; j < nexp_; ++j)
             {
-            Cplx z = (Cplx(ReLambda_(j),ImLambda_(j))).pow(i);
-            L(i,2*j-1) = z.a;
-            L(i,2*j) = -z.b;
+            h.el(2*j) = zr[j];
+            h.el(2*j+1) = -zi[j];
+
+            const Real na = zr[j]*ReLambda_(j+1) - zi[j]*ImLambda_(j+1);
+            zi[j] = zi[j]*ReLambda_(j+1) + zr[j]*ImLambda_(j+1);
+            zr[j] = na;
             }
+        h.el(nc) = fv_(i);
+        qrAddRow(R,h);
         }
 
-    Matrix Li;
-    PseudoInverse(L,Li,1E-12);
+    Matrix Ri;
+    PseudoInverse(R.SubMatrix(1,nc,1,nc),Ri,1E-12);
+
+    Vector qtf(nc);
+    for(int a = 1; a <= nc; ++a) 
+        qtf(a) = R(a,nc+1);
 
-    Vector ChiCombined = Li*fv;
+    Vector ChiCombined = Ri*qtf;
 
     //Unpack Chi vector into real
     //and imaginary parts
@@ -315,6 +1053,160 @@ init()
 
     }
 
+//
+// Same least squares problem as fitWeights, solved
+// through the (column scaled) normal equations
+// L^T L chi = L^T fv accumulated row by row, 
+// so L is never stored and no SVD of it is needed
+//
+void inline ExpFit::
+fitWeightsNormal(const Vector& fv)
+    {
+    const int nc = 2*nexp_;
+
+    Matrix A(nc,nc); A = 0;
+    Vector b(nc); b = 0;
+
+    std::vector<Real> zr(nexp_),
+                      zi(nexp_),
+                      row(nc);
+    for(int j = 0; j < nexp_; ++j)
+        {
+        zr[j] = ReLambda_(j+1);
+        zi[j] = ImLambda_(j+1);
+        }
+
+    for(int i = 1; i <= Nb_; ++i)
+        {
+        for(int j = 0; j < nexp_; ++j)
+            {
+            row[2*j] = zr[j];
+            row[2*j+1] = -zi[j];
+
+            const Real na = zr[j]*ReLambda_(j+1) - zi[j]*ImLambda_(j+1);
+            zi[j] = zi[j]*ReLambda_(j+1) + zr[j]*ImLambda_(j+1);
+            zr[j] = na;
+            }
+        for(int a = 0; a < nc; ++a)
+            {
+            b.el(a) += row[a]*fv(i);
+            for(int c = a; c < nc; ++c)
+                A.el(a,c) += row[a]*row[c];
+            }
+        }
+
+    Vector scale(nc);
+    for(int a = 0; a < nc; ++a)
+        scale.el(a) = (A.el(a,a) > 0 ? 1./sqrt(A.el(a,a)) : 0);
+
+    for(int a = 0; a < nc; ++a)
+        {
+        b.el(a) *= scale.el(a);
+        for(int c = a; c < nc; ++c)
+            {
+            A.el(a,c) *= scale.el(a)*scale.el(c);
+            A.el(c,a) = A.el(a,c);
+            }
+        }
+
+    Vector evals;
+    Matrix evecs;
+    EigenValues(A,evals,evecs);
+
+    Real maxev = 0;
+    for(int a = 1; a <= nc; ++a) 
+        maxev = max(maxev,fabs(evals(a)));
+
+    Vector ChiCombined(nc); ChiCombined = 0;
+    for(int e = 1; e <= nc; ++e)
+        {
+        if(evals(e) <= 1E-14*maxev) continue;
+        Real proj = 0;
+        for(int a = 1; a <= nc; ++a) 
+            proj += evecs(a,e)*b(a);
+        proj /= evals(e);
+        for(int a = 1; a <= nc; ++a) 
+            ChiCombined(a) += proj*evecs(a,e);
+        }
+
+    ReChi_.ReDimension(nexp_);
+    ImChi_.ReDimension(nexp_);
+    for(int j = 1; j <= nexp_; ++j)
+        {
+        ReChi_(j) = ChiCombined(2*j-1)*scale(2*j-1);
+        ImChi_(j) = ChiCombined(2*j)*scale(2*j);
+        }
+    }
+
+//
+// Largest deviation of the fit from the tabulated
+// values fv(d), with lambda^d built up by
+// running products instead of repeated powers
+//
+Real inline ExpFit::
+fitDiff(const Vector& fv, bool relative) const
+    {
+    Vector fit;
+    evaluate(fit,fv.Length());
+
+    Real maxdiff = 0;
+    for(int d = 1; d <= fv.Length(); ++d)
+        {
+        Real diff = fabs(fv(d) - fit(d));
+        if(relative && fv(d) != 0) diff /= fabs(fv(d));
+        //Also catches NaN
+        if(!(diff <= 1E300)) return 1E300;
+        maxdiff = max(maxdiff,diff);
+        }
+    return maxdiff;
+    }
+
+//
+// lambda^d is carried along as a running product,
+// one re/im lane per exponential, so the inner loop
+// over exponentials has no dependencies between
+// lanes and can be vectorized
+//
+void inline ExpFit::
+evaluate(Vector& res, int n) const
+    {
+    if(n < 0) n = Nb_;
+    res.ReDimension(n);
+
+    const int ne = ReLambda_.Length();
+    std::vector<Real> lr(ne), li(ne),
+                      cr(ne), ci(ne),
+                      zr(ne), zi(ne);
+    for(int k = 0; k < ne; ++k)
+        {
+        lr[k] = zr[k] = ReLambda_(k+1);
+        li[k] = zi[k] = ImLambda_(k+1);
+        cr[k] = ReChi_(k+1);
+        ci[k] = ImChi_(k+1);
+        }
+
+    Real maxim = 0;
+    for(int d = 1; d <= n; ++d)
+        {
+        Real re = 0, 
+             im = 0;
+        for(int k = 0; k < ne; ++k)
+            {
+            re += cr[k]*zr[k] - ci[k]*zi[k];
+            im += cr[k]*zi[k] + ci[k]*zr[k];
+
+            const Real nr = zr[k]*lr[k] - zi[k]*li[k];
+            zi[k] = zi[k]*lr[k] + zr[k]*li[k];
+            zr[k] = nr;
+            }
+        res(d) = re;
+        maxim = max(maxim,fabs(im));
+        }
+
+    if(maxim > 1E-3) 
+        warnImag(maxim);
+    }
+
 Real inline ExpFit::
 operator()(int d) const
     {
@@ -326,15 +1218,76 @@ operator()(int d) const
         res += chi*lambda.pow(d);
         }
     if(fabs(res.b) > 1E-3) 
+        warnImag(fabs(res.b));
+    return res.a;
+    }
+
+void inline ExpFit::
+warnImag(Real im) const
+    {
+    if(++nimag_ < 10)
+        warnings_ += (boost::format("WARNING: non-zero imaginary part of fit, %.3E\n") % im).str();
+    }
+
+//
+// Binary format: version, N, nexp, then
+// ReLambda, ImLambda, ReChi, ImChi
+//
+void inline ExpFit::
+read(std::istream& s)
+    {
+    int version = 0;
+    s.read((char*) &version,sizeof(version));
+    if(version != 1) 
+        Error("ExpFit::read: unrecognized file version");
+
+    s.read((char*) &N_,sizeof(N_));
+    s.read((char*) &nexp_,sizeof(nexp_));
+    Nb_ = N_-1;
+
+    const int ne = max(1,nexp_);
+    Vector* vs[] = { &ReLambda_, &ImLambda_, &ReChi_, &ImChi_ };
+    for(int n = 0; n < 4; ++n)
         {
-        static int count = 0;
-        if(++count < 10)
-            {
-            std::cout << "WARNING: non-zero imaginary part of fit" << std::endl;
-            std::cout << boost::format("    res.b = %.3E\n") % res.b;
-            }
+        vs[n]->ReDimension(ne);
+        for(int k = 1; k <= ne; ++k)
+            s.read((char*) &((*vs[n])(k)),sizeof(Real));
         }
-    return res.a;
+
+    if(s.fail()) 
+        Error("ExpFit::read: error reading fit");
+    }
+
+void inline ExpFit::
+write(std::ostream& s) const
+    {
+    const int version = 1;
+    s.write((const char*) &version,sizeof(version));
+    s.write((const char*) &N_,sizeof(N_));
+    s.write((const char*) &nexp_,sizeof(nexp_));
+
+    const Vector* vs[] = { &ReLambda_, &ImLambda_, &ReChi_, &ImChi_ };
+    for(int n = 0; n < 4; ++n)
+    for(int k = 1; k <= vs[n]->Length(); ++k)
+        {
+        const Real x = (*vs[n])(k);
+        s.write((const char*) &x,sizeof(x));
+        }
+    }
+
+int inline ExpFit::
+nchannel() const
+    {
+    int nchan = nexp_;
+    for(int k = 1; k <= nexp_; ++k) 
+        if(isComplex(k)) ++nchan;
+    return nchan;
+    }
+
+Real inline ExpFit::
+maxDiff(bool relative) const
+    {
+    return fitDiff(fv_,relative);
     }
 
 void inline ExpFit::
@@ -343,24 +1296,20 @@ stats(bool& lambda_is_real, Real& maxdiff, int& maxdiff_pos, Real& avgdiff) cons
     if(Norm(ImLambda_) > 1E-10) lambda_is_real = false;
     else lambda_is_real = true;
 
+    Vector fit;
+    evaluate(fit,Nb_);
+
     avgdiff = 0.0;
     maxdiff = -1.0;
     maxdiff_pos = -1;
-    Real mindiff = 10000.0;
-    int mindiff_pos = -1;
     for(int d = 1; d <= Nb_; ++d)
         {
-        Real diff = fabs((*f_)(d) - operator()(d));
+        Real diff = fabs(fv_(d) - fit(d));
         if(diff > maxdiff)
             {
             maxdiff = diff;
             maxdiff_pos = d;
             }
-        if(diff < mindiff) 
-            {
-            mindiff = diff;
-            mindiff_pos = d;
-            }
         avgdiff += diff;
         }
     avgdiff /= Nb_;
@@ -0,0 +1,289 @@
+#ifndef __MEASURE_H
+#define __MEASURE_H
+#include "siteterms.h"
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+
+#define Cout std::cout
+#define Endl std::endl
+#define Format boost::format
+
+//
+// Measures a list of one-site operators <A_j> and
+// two-site correlators <A_i B_j> (i < j) in a single left
+// to right pass over the MPS. Right environments R_j of
+// sites j+1..N are made once; going left to right, the
+// plain left environment L and, for every correlator and
+// every i already passed, the environment with A_i in it
+// are each extended by one site, and every environment is
+// closed with R_j after putting in the operator of site j.
+// That is O(N) contractions for all one-site values and
+// O(N^2) for all correlators, with no psi.position moves.
+// Each correlator keeps up to N m x m environments in
+// memory until the pass is done, about N*m^2*8 bytes.
+//
+// Operators are named as in SiteTerms (Id, Sp, Sm, Sz,
+// Sx, ISy); correlators as "A:B". Lists are separated by
+// commas or spaces, e.g. "Sz:Sz,Sp:Sm".
+//
+template<class Tensor>
+class Measurements
+    {
+    public:
+
+    typedef SiteTerms::OpType OpType;
+
+    Measurements() { }
+
+    Measurements(const std::string& ops, const std::string& pairs)
+        {
+        addSites(ops);
+        addPairs(pairs);
+        }
+
+    void
+    addSite(const std::string& op) { site_.push_back(opType(op)); }
+
+    void
+    addPair(const std::string& opA, const std::string& opB)
+        {
+        pairA_.push_back(opType(opA));
+        pairB_.push_back(opType(opB));
+        }
+
+    void
+    addSites(const std::string& ops);
+
+    void
+    addPairs(const std::string& pairs);
+
+    void
+    measure(MPSt<Tensor>& psi);
+
+    //<A_j> for the n-th one-site operator
+    Real
+    site(int n, int j) const { return sval_.at(n).at(j); }
+
+    //<A_i B_j> for the n-th correlator, i < j
+    Real
+    pair(int n, int i, int j) const { return pval_.at(n).at(i).at(j); }
+
+    //Prints the one-site values as "A j <A_j>"
+    void
+    print() const;
+
+    //
+    // Writes every value to fname in four columns,
+    // op i j value, with j = 0 for one-site operators
+    // and op = AB for the correlator <A_i B_j>
+    //
+    void
+    write(const std::string& fname) const;
+
+    static OpType
+    opType(const std::string& name);
+
+    static const char*
+    opName(OpType t);
+
+    private:
+
+    std::vector<OpType> site_,
+                        pairA_,
+                        pairB_;
+
+    std::vector<std::vector<Real> > sval_;
+    std::vector<std::vector<std::vector<Real> > > pval_;
+
+    static void
+    convert(const IQTensor& op, IQTensor& res) { res = op; }
+    static void
+    convert(const IQTensor& op, ITensor& res) { res = op.toITensor(); }
+
+    static std::string
+    separate(std::string list)
+        {
+        std::replace(list.begin(),list.end(),',',' ');
+        return list;
+        }
+
+    static Tensor
+    op(const Model& model, int j, OpType t)
+        {
+        Tensor res;
+        convert(SiteTerms::op(model,j,t),res);
+        return res;
+        }
+
+    };
+
+template<class Tensor>
+typename Measurements<Tensor>::OpType inline Measurements<Tensor>::
+opType(const std::string& name)
+    {
+    for(int t = 0; t < SiteTerms::NumOpType; ++t)
+        {
+        if(name == opName(OpType(t))) return OpType(t);
+        }
+    Error("Measurements: unknown operator " + name);
+    return SiteTerms::Id;
+    }
+
+template<class Tensor>
+inline const char* Measurements<Tensor>::
+opName(OpType t)
+    {
+    static const char* names[] = { "Id", "Sp", "Sm", "Sz", "Sx", "ISy" };
+    return names[t];
+    }
+
+template<class Tensor>
+void inline Measurements<Tensor>::
+addSites(const std::string& ops)
+    {
+    std::istringstream s(separate(ops));
+    std::string op;
+    while(s >> op) addSite(op);
+    }
+
+template<class Tensor>
+void inline Measurements<Tensor>::
+addPairs(const std::string& pairs)
+    {
+    std::istringstream s(separate(pairs));
+    std::string p;
+    while(s >> p)
+        {
+        const size_t c = p.find(':');
+        if(c == std::string::npos) Error("Measurements: correlator " + p + " is not of the form A:B");
+        addPair(p.substr(0,c),p.substr(c+1));
+        }
+    }
+
+template<class Tensor>
+void inline Measurements<Tensor>::
+measure(MPSt<Tensor>& psi)
+    {
+    const Model& model = psi.model();
+    const int N = model.NN();
+    const int nsite = site_.size(),
+              npair = pairA_.size();
+
+    sval_.assign(nsite,std::vector<Real>(N+1,0));
+    pval_.assign(npair,std::vector<std::vector<Real> >(N+1,std::vector<Real>(N+1,0)));
+
+    psi.position(1);
+
+    std::vector<Tensor> R(N+2);
+    if(N > 1)
+        {
+        R.at(N-1) = conj(primelink(psi.AA(N)))*psi.AA(N);
+        for(int j = N-1; j > 1; --j)
+            {
+            R.at(j-1) = R.at(j);
+            R.at(j-1) *= conj(primelink(psi.AA(j)));
+            R.at(j-1) *= psi.AA(j);
+            }
+        }
+
+    //E[n][i] holds sites 1..j-1 with A_i of correlator n
+    std::vector<std::vector<Tensor> > E(npair,std::vector<Tensor>(N+1));
+
+    Tensor L;
+    for(int j = 1; j <= N; ++j)
+        {
+        const Tensor bra = conj(primed(psi.AA(j))),
+                     braL = conj(primelink(psi.AA(j)));
+
+        //Closes ket, which has psi.AA(j) and an operator
+        //on site j in it, with the right environment
+        Tensor ket;
+        Tensor kl = psi.AA(j);
+        if(j != 1) kl *= L;
+
+        for(int n = 0; n < nsite; ++n)
+            {
+            ket = kl * op(model,j,site_[n]);
+            if(j == N)
+                sval_[n][j] = Dot(bra,ket);
+            else
+                {
+                ket *= bra;
+                sval_[n][j] = Dot(R.at(j),ket);
+                }
+            }
+
+        for(int n = 0; n < npair; ++n)
+            {
+            const Tensor opB = op(model,j,pairB_[n]);
+            for(int i = 1; i < j; ++i)
+                {
+                Tensor& Ei = E[n][i];
+                Ei *= psi.AA(j);
+                ket = Ei * opB;
+                if(j == N)
+                    pval_[n][i][j] = Dot(bra,ket);
+                else
+                    {
+                    ket *= bra;
+                    pval_[n][i][j] = Dot(R.at(j),ket);
+                    Ei *= braL;
+                    }
+                }
+            if(j == N) continue;
+
+            //Start the environment of A_j
+            E[n][j] = kl * op(model,j,pairA_[n]);
+            E[n][j] *= bra;
+            }
+
+        if(j == N) break;
+        if(j == 1)
+            L = psi.AA(j)*braL;
+        else
+            {
+            L *= psi.AA(j);
+            L *= braL;
+            }
+        }
+    }
+
+template<class Tensor>
+void inline Measurements<Tensor>::
+print() const
+    {
+    for(size_t n = 0; n < site_.size(); ++n)
+        {
+        for(size_t j = 1; j < sval_.at(n).size(); ++j)
+            Cout << Format("%s %d %.10f") % opName(site_[n]) % j % sval_[n][j] << Endl;
+        if(n+1 < site_.size()) Cout << Endl << Endl;
+        }
+    }
+
+template<class Tensor>
+void inline Measurements<Tensor>::
+write(const std::string& fname) const
+    {
+    std::ofstream f(fname.c_str());
+    if(!f) Error("Measurements: could not open " + fname);
+    f << "#op i j value" << std::endl;
+    for(size_t n = 0; n < site_.size(); ++n)
+        {
+        for(size_t j = 1; j < sval_.at(n).size(); ++j)
+            f << Format("%s %d 0 %.12f") % opName(site_[n]) % j % sval_[n][j] << std::endl;
+        }
+    for(size_t n = 0; n < pairA_.size(); ++n)
+        {
+        const std::vector<std::vector<Real> >& v = pval_.at(n);
+        for(size_t i = 1; i < v.size(); ++i)
+        for(size_t j = i+1; j < v.size(); ++j)
+            f << Format("%s%s %d %d %.12f") % opName(pairA_[n]) % opName(pairB_[n]) % i % j % v[i][j] << std::endl;
+        }
+    }
+
+#undef Cout
+#undef Endl
+#undef Format
+
+#endif
@@ -0,0 +1,495 @@
+#ifndef __MPOCOMPRESS_H
+#define __MPOCOMPRESS_H
+#include "siteterms.h"
+#include <map>
+
+//
+// Compresses an MPO given as SiteTerms tables W[1..N],
+// W[j] taking the channels of bond j-1 to those of bond j.
+// Every bond starts out with channels 1..k, channel c being
+// in QN block sector[c] (0, 1, 2 for the QN -2, +2 and 0
+// blocks); the left edge picks channel k, the right one ds.
+//
+// Deparallelization (exact): going left to right, a channel
+// whose column in W[b] is alpha times that of an earlier
+// channel in the same block is dropped, alpha times its row
+// in W[b+1] being added to the earlier channel's row; then
+// the same right to left for rows of W[b+1]. Channels in
+// different QN blocks are never combined.
+//
+// With tol > 0 the channels of each block are also
+// truncated by an SVD of their columns, keeping singular
+// values above tol times the largest one (lossy). Each
+// block is cut on its own without bringing the MPO to
+// canonical form first, so the singular values are not
+// those of the operator's Schmidt decomposition and tol
+// gives no bound on the error of the truncated MPO.
+//
+class MPOCompressor
+    {
+    public:
+
+    MPOCompressor(const std::vector<SiteTerms>& W, const std::vector<int>& sector,
+                  int ds, int k);
+
+    void
+    compress(Real tol = 0);
+
+    //Largest number of channels on an inner bond
+    int
+    maxBondDim() const;
+
+    //Tables with the channels of each inner bond renumbered
+    //as its QN -2 block, then +2, then 0 (ds first and k last),
+    //and the block sizes of every bond b = 0..N
+    void
+    result(std::vector<SiteTerms>& W, std::vector<std::vector<int> >& sizes) const;
+
+    private:
+
+    struct Key
+        {
+        int row,
+            col,
+            op;
+
+        Key(int r, int c, int o) : row(r), col(c), op(o) { }
+
+        bool
+        operator<(const Key& other) const
+            {
+            if(row != other.row) return row < other.row;
+            if(col != other.col) return col < other.col;
+            return op < other.op;
+            }
+        };
+
+    typedef std::map<Key,Real>
+    Site;
+
+    //A row or column: (col or row, op) -> coefficient
+    typedef std::map<std::pair<int,int>,Real>
+    Vec;
+
+    /////////////
+    //
+    // Data Members
+
+    int N_,
+        ds_,
+        k_;
+
+    std::vector<Site> W_;
+
+    std::vector<int> sector_;
+
+    //alive_[b][c]: channel c of bond b is still in use
+    std::vector<std::vector<bool> > alive_;
+
+    //
+    /////////////
+
+    static void
+    add(Site& s, const Key& key, Real x);
+
+    //Columns of W[b] and rows of W[b+1], both
+    //indexed by the channels of bond b
+    void
+    columns(int b, std::map<int,Vec>& cols) const;
+    void
+    rows(int b, std::map<int,Vec>& rws) const;
+
+    Vec
+    takeColumn(int b, int c);
+    Vec
+    takeRow(int b, int c);
+
+    bool
+    sweepLeft();
+    bool
+    sweepRight();
+
+    void
+    truncate(int b, Real tol);
+
+    bool
+    fixed(int c) const { return c == ds_ || c == k_; }
+
+    bool
+    lastInSector(int b, int c) const;
+
+    static bool
+    parallel(const Vec& a, const Vec& b, Real& alpha);
+
+    };
+
+inline MPOCompressor::
+MPOCompressor(const std::vector<SiteTerms>& W, const std::vector<int>& sector,
+              int ds, int k)
+    :
+    N_(int(W.size())-1),
+    ds_(ds),
+    k_(k),
+    W_(W.size()),
+    sector_(sector),
+    alive_(W.size(),std::vector<bool>(k+1,true))
+    {
+    for(int j = 1; j <= N_; ++j)
+        {
+        const std::vector<SiteTerms::Term>& terms = W.at(j).terms();
+        for(size_t n = 0; n < terms.size(); ++n)
+            {
+            const SiteTerms::Term& t = terms[n];
+            add(W_[j],Key(t.row,t.col,t.op),t.coef);
+            }
+        }
+    for(int b = 0; b <= N_; ++b)
+        alive_[b][0] = false;
+    }
+
+void inline MPOCompressor::
+compress(Real tol)
+    {
+    //Only what the edges pick out matters on the outer bonds
+    for(Site::iterator it = W_.at(1).begin(); it != W_.at(1).end();)
+        {
+        if(it->first.row != k_) W_[1].erase(it++);
+        else ++it;
+        }
+    for(Site::iterator it = W_.at(N_).begin(); it != W_.at(N_).end();)
+        {
+        if(it->first.col != ds_) W_[N_].erase(it++);
+        else ++it;
+        }
+
+    for(int n = 0; n < 10; ++n)
+        {
+        bool changed = sweepLeft();
+        changed = sweepRight() || changed;
+        if(!changed) break;
+        }
+
+    if(tol <= 0) return;
+
+    for(int b = 1; b < N_; ++b)
+        truncate(b,tol);
+
+    for(int n = 0; n < 10; ++n)
+        {
+        bool changed = sweepLeft();
+        changed = sweepRight() || changed;
+        if(!changed) break;
+        }
+    }
+
+int inline MPOCompressor::
+maxBondDim() const
+    {
+    int res = 0;
+    for(int b = 1; b < N_; ++b)
+        {
+        int nc = 0;
+        for(int c = 1; c <= k_; ++c)
+            if(alive_[b][c]) ++nc;
+        res = max(res,nc);
+        }
+    return res;
+    }
+
+void inline MPOCompressor::
+result(std::vector<SiteTerms>& W, std::vector<std::vector<int> >& sizes) const
+    {
+    W.assign(N_+1,SiteTerms());
+    sizes.assign(N_+1,std::vector<int>(3,0));
+
+    std::vector<std::vector<int> > newid(N_+1,std::vector<int>(k_+1,0));
+    for(int b = 0; b <= N_; ++b)
+        {
+        std::vector<int> order;
+        for(int s = 0; s <= 2; ++s)
+            {
+            if(s == 2 && alive_[b][ds_]) order.push_back(ds_);
+            for(int c = 1; c <= k_; ++c)
+                {
+                if(!alive_[b][c] || sector_[c] != s || fixed(c)) continue;
+                order.push_back(c);
+                }
+            if(s == 2 && alive_[b][k_]) order.push_back(k_);
+            }
+        for(size_t n = 0; n < order.size(); ++n)
+            {
+            newid[b][order[n]] = n+1;
+            sizes[b][sector_[order[n]]] += 1;
+            }
+        }
+
+    for(int j = 1; j <= N_; ++j)
+    for(Site::const_iterator it = W_[j].begin(); it != W_[j].end(); ++it)
+        {
+        const Key& key = it->first;
+        W[j].add(newid[j-1][key.row],newid[j][key.col],SiteTerms::OpType(key.op),it->second);
+        }
+    }
+
+void inline MPOCompressor::
+add(Site& s, const Key& key, Real x)
+    {
+    Site::iterator it = s.find(key);
+    if(it == s.end())
+        {
+        if(x != 0) s[key] = x;
+        return;
+        }
+    const Real nv = it->second + x;
+    //Drop what cancels up to roundoff
+    if(fabs(nv) <= 1E-13*(fabs(it->second)+fabs(x)))
+        s.erase(it);
+    else
+        it->second = nv;
+    }
+
+void inline MPOCompressor::
+columns(int b, std::map<int,Vec>& cols) const
+    {
+    cols.clear();
+    for(Site::const_iterator it = W_[b].begin(); it != W_[b].end(); ++it)
+        {
+        const Key& key = it->first;
+        cols[key.col][std::make_pair(key.row,key.op)] = it->second;
+        }
+    }
+
+void inline MPOCompressor::
+rows(int b, std::map<int,Vec>& rws) const
+    {
+    rws.clear();
+    for(Site::const_iterator it = W_[b+1].begin(); it != W_[b+1].end(); ++it)
+        {
+        const Key& key = it->first;
+        rws[key.row][std::make_pair(key.col,key.op)] = it->second;
+        }
+    }
+
+//Removes column c of W[b], returning it
+MPOCompressor::Vec inline MPOCompressor::
+takeColumn(int b, int c)
+    {
+    Vec res;
+    Site& s = W_[b];
+    for(Site::iterator it = s.begin(); it != s.end();)
+        {
+        if(it->first.col == c)
+            {
+            res[std::make_pair(it->first.row,it->first.op)] = it->second;
+            s.erase(it++);
+            }
+        else ++it;
+        }
+    return res;
+    }
+
+//Removes row c of W[b+1], returning it
+MPOCompressor::Vec inline MPOCompressor::
+takeRow(int b, int c)
+    {
+    Vec res;
+    Site& s = W_[b+1];
+    Site::iterator it = s.lower_bound(Key(c,-1,-1));
+    while(it != s.end() && it->first.row == c)
+        {
+        res[std::make_pair(it->first.col,it->first.op)] = it->second;
+        s.erase(it++);
+        }
+    return res;
+    }
+
+bool inline MPOCompressor::
+sweepLeft()
+    {
+    bool changed = false;
+    std::map<int,Vec> cols;
+    for(int b = 1; b < N_; ++b)
+        {
+        columns(b,cols);
+        std::vector<int> kept;
+        for(int c = 1; c <= k_; ++c)
+            {
+            if(!alive_[b][c]) continue;
+
+            std::map<int,Vec>::const_iterator it = cols.find(c);
+            if(it == cols.end())
+                {
+                //Nothing ever enters this channel
+                if(fixed(c) || lastInSector(b,c)) continue;
+                takeRow(b,c);
+                alive_[b][c] = false;
+                changed = true;
+                continue;
+                }
+
+            bool merged = false;
+            for(size_t n = 0; n < kept.size() && !fixed(c); ++n)
+                {
+                const int c2 = kept[n];
+                Real alpha = 0;
+                if(sector_[c2] != sector_[c] || !parallel(it->second,cols[c2],alpha)) continue;
+
+                takeColumn(b,c);
+                const Vec row = takeRow(b,c);
+                for(Vec::const_iterator r = row.begin(); r != row.end(); ++r)
+                    add(W_[b+1],Key(c2,r->first.first,r->first.second),alpha*r->second);
+                alive_[b][c] = false;
+                merged = changed = true;
+                break;
+                }
+            if(!merged) kept.push_back(c);
+            }
+        }
+    return changed;
+    }
+
+bool inline MPOCompressor::
+sweepRight()
+    {
+    bool changed = false;
+    std::map<int,Vec> rws;
+    for(int b = N_-1; b >= 1; --b)
+        {
+        rows(b,rws);
+        std::vector<int> kept;
+        for(int c = 1; c <= k_; ++c)
+            {
+            if(!alive_[b][c]) continue;
+
+            std::map<int,Vec>::const_iterator it = rws.find(c);
+            if(it == rws.end())
+                {
+                //Nothing ever leaves this channel
+                if(fixed(c) || lastInSector(b,c)) continue;
+                takeColumn(b,c);
+                alive_[b][c] = false;
+                changed = true;
+                continue;
+                }
+
+            bool merged = false;
+            for(size_t n = 0; n < kept.size() && !fixed(c); ++n)
+                {
+                const int c2 = kept[n];
+                Real alpha = 0;
+                if(sector_[c2] != sector_[c] || !parallel(it->second,rws[c2],alpha)) continue;
+
+                takeRow(b,c);
+                const Vec col = takeColumn(b,c);
+                for(Vec::const_iterator r = col.begin(); r != col.end(); ++r)
+                    add(W_[b],Key(r->first.first,c2,r->first.second),alpha*r->second);
+                alive_[b][c] = false;
+                merged = changed = true;
+                break;
+                }
+            if(!merged) kept.push_back(c);
+            }
+        }
+    return changed;
+    }
+
+void inline MPOCompressor::
+truncate(int b, Real tol)
+    {
+    std::map<int,Vec> cols;
+    columns(b,cols);
+
+    for(int s = 0; s <= 2; ++s)
+        {
+        std::vector<int> ch;
+        for(int c = 1; c <= k_; ++c)
+            {
+            if(alive_[b][c] && sector_[c] == s && !fixed(c) && cols.count(c))
+                ch.push_back(c);
+            }
+        const int nc = ch.size();
+        if(nc < 2) continue;
+
+        std::map<std::pair<int,int>,int> keyind;
+        for(int n = 0; n < nc; ++n)
+        for(Vec::const_iterator it = cols[ch[n]].begin(); it != cols[ch[n]].end(); ++it)
+            {
+            if(!keyind.count(it->first))
+                {
+                const int q = keyind.size()+1;
+                keyind[it->first] = q;
+                }
+            }
+
+        Matrix A(keyind.size(),nc); A = 0;
+        for(int n = 0; n < nc; ++n)
+        for(Vec::const_iterator it = cols[ch[n]].begin(); it != cols[ch[n]].end(); ++it)
+            {
+            A(keyind[it->first],n+1) = it->second;
+            }
+
+        Matrix U,V;
+        Vector D;
+        SVD(A,U,D,V);
+
+        int nr = 0;
+        for(int i = 1; i <= D.Length(); ++i)
+            if(D(i) > tol*D(1)) ++nr;
+        if(nr >= nc) continue;
+
+        std::vector<Vec> oldrows(nc);
+        for(int n = 0; n < nc; ++n)
+            {
+            takeColumn(b,ch[n]);
+            oldrows[n] = takeRow(b,ch[n]);
+            }
+
+        //Channel ch[i-1] now carries column U_i D_i, and
+        //its row is the V-weighted sum of the old rows
+        for(int i = 1; i <= nr; ++i)
+            {
+            const int c = ch[i-1];
+            for(std::map<std::pair<int,int>,int>::const_iterator it = keyind.begin(); it != keyind.end(); ++it)
+                add(W_[b],Key(it->first.first,c,it->first.second),U(it->second,i)*D(i));
+            for(int n = 0; n < nc; ++n)
+            for(Vec::const_iterator r = oldrows[n].begin(); r != oldrows[n].end(); ++r)
+                add(W_[b+1],Key(c,r->first.first,r->first.second),V(i,n+1)*r->second);
+            }
+        for(int i = nr+1; i <= nc; ++i)
+            alive_[b][ch[i-1]] = false;
+        }
+    }
+
+bool inline MPOCompressor::
+lastInSector(int b, int c) const
+    {
+    for(int c2 = 1; c2 <= k_; ++c2)
+        {
+        if(c2 != c && alive_[b][c2] && sector_[c2] == sector_[c]) return false;
+        }
+    return true;
+    }
+
+//True if a = alpha*b
+bool inline MPOCompressor::
+parallel(const Vec& a, const Vec& b, Real& alpha)
+    {
+    if(a.size() != b.size() || a.empty()) return false;
+
+    Vec::const_iterator ia = a.begin(),
+                        ib = b.begin();
+    alpha = ia->second/ib->second;
+    Real scale = 0;
+    for(; ia != a.end(); ++ia, ++ib)
+        {
+        if(ia->first != ib->first) return false;
+        scale = max(scale,fabs(ia->second));
+        }
+    for(ia = a.begin(), ib = b.begin(); ia != a.end(); ++ia, ++ib)
+        {
+        if(fabs(ia->second - alpha*ib->second) > 1E-12*scale) return false;
+        }
+    return true;
+    }
+
+#endif
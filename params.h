@@ -9,8 +9,13 @@ class Params
     public:
 
     Real
+    checkpoint_minutes,
+    compress_tol,
     cutoff,
+    davidson_rate,
+    energy_tol,
     esaccuracy,
+    fit_tol,
     J,
     K,
     LambdaXY,
@@ -20,13 +25,22 @@ class Params
     param_start,
     param_step,
     pinning,
+    trunc_tol,
     xi;
 
     int
+    adaptive_sweeps,
+    checkpoint_bonds,
+    compress_mpo,
+    davidson_policy,
     do_param_sweep,
     do_plot_self,
     do_timing,
+    fit_cache,
+    fit_refine,
+    fit_reltol,
     interaction_cutoff,
+    joint_fit,
     max_p,
     max_p_leg,
     max_p_rung,
@@ -42,17 +56,24 @@ class Params
     printH,
     quiet,
     quiet_dmrg,
+    resume,
     smooth,
+    sparse_mpo,
     stagger_pinning,
     triplet_sector,
     use_tmpdir,
+    write_entropy,
     write_m;
 
     std::string
+    measure_pairs,
+    measure_site,
+    mpo_cache,
     nthreads,
     runmode,
     sweep_param,
     sweep_scheme,
+    timing_file,
     wfname,
     write_dir;
 
@@ -68,8 +89,14 @@ class Params
         //Defaults for optional params
 
         //Real
+        checkpoint_minutes = 0;
+        //Per-block SVD cutoff of compress_mpo, not an error bound
+        compress_tol = 0;
         cutoff = 1E-8;
+        davidson_rate = 0.1;
+        energy_tol = 1E-8;
         esaccuracy = -1;
+        fit_tol = -1;
         J = 1;
         LambdaXY = 1;
         LambdaZ = 1;
@@ -78,13 +105,23 @@ class Params
         param_start = -37;
         param_step = -1;
         pinning = 0;
+        trunc_tol = 1E-8;
         xi = 1;
 
         //int
+        adaptive_sweeps = 0;
+        checkpoint_bonds = 0;
+        compress_mpo = 0;
+        davidson_policy = 0;
         do_param_sweep = 0;
         do_plot_self = 0;
         do_timing = 0;
+        //Writes fit_* files to the working directory
+        fit_cache = 0;
+        fit_refine = 0;
+        fit_reltol = 0;
         interaction_cutoff = -1;
+        joint_fit = 0;
         max_p = 25;
         max_p_leg = -1;
         max_p_rung = -1;
@@ -99,32 +136,56 @@ class Params
         printH = 0;
         quiet = 1;
         quiet_dmrg = 1;
+        resume = 0;
         smooth = 0;
+        sparse_mpo = 0;
         stagger_pinning = 0;
         use_tmpdir = 0;
+        write_entropy = 0;
         write_m = -1;
 
         //string
+        //e.g. "Sz:Sz,Sp:Sm"; each keeps N environments in memory
+        measure_pairs = "";
+        measure_site = "Sz";
+        mpo_cache = "";
         nthreads = "";
         runmode = "solve";
         sweep_param = "lambdaxy";
         sweep_scheme = "ramp_m";
+        timing_file = "timing.jsonl";
         wfname = "";
         write_dir = "";
 
         //Get optional params
+        basic.GetYesNo("adaptive_sweeps",adaptive_sweeps);
+        basic.GetInt("checkpoint_bonds",checkpoint_bonds);
+        basic.GetReal("checkpoint_minutes",checkpoint_minutes);
+        basic.GetYesNo("compress_mpo",compress_mpo);
+        basic.GetReal("compress_tol",compress_tol);
+        basic.GetYesNo("davidson_policy",davidson_policy);
+        basic.GetReal("davidson_rate",davidson_rate);
         basic.GetYesNo("do_plot_self",do_plot_self);
         basic.GetYesNo("do_timing",do_timing);
+        basic.GetReal("energy_tol",energy_tol);
         basic.GetReal("esaccuracy",esaccuracy);
+        basic.GetYesNo("fit_cache",fit_cache);
+        basic.GetYesNo("fit_refine",fit_refine);
+        basic.GetYesNo("fit_reltol",fit_reltol);
+        basic.GetReal("fit_tol",fit_tol);
         basic.GetReal("J",J);
         basic.GetReal("K",K);
         basic.GetReal("LambdaXY",LambdaXY);
         basic.GetReal("LambdaZ",LambdaZ);
         basic.GetInt("interaction_cutoff",interaction_cutoff);
+        basic.GetYesNo("joint_fit",joint_fit);
         basic.GetInt("max_p",max_p);
         basic.GetInt("max_p_leg",max_p_leg);
         basic.GetInt("max_p_rung",max_p_rung);
         basic.GetInt("min_sweeps",min_sweeps);
+        basic.GetString("measure_pairs",measure_pairs);
+        basic.GetString("measure_site",measure_site);
+        basic.GetString("mpo_cache",mpo_cache);
         basic.GetYesNo("nn",nn);
         basic.GetInt("nstates",nstates);
         basic.GetInt("nsweeps",nsweeps);
@@ -139,15 +200,20 @@ class Params
         basic.GetYesNo("printH",printH);
         basic.GetYesNo("quiet",quiet);
         basic.GetYesNo("quiet_dmrg",quiet_dmrg);
+        basic.GetYesNo("resume",resume);
         basic.GetString("runmode",runmode);
         basic.GetYesNo("smooth",smooth);
+        basic.GetYesNo("sparse_mpo",sparse_mpo);
         basic.GetYesNo("stagger_pinning",stagger_pinning);
         basic.GetString("sweep_scheme",sweep_scheme);
+        basic.GetString("timing_file",timing_file);
         basic.GetYesNo("triplet_sector",triplet_sector);
         basic.GetYesNo("use_tmpdir",use_tmpdir);
+        basic.GetYesNo("write_entropy",write_entropy);
         basic.GetString("wfname",wfname);
         basic.GetString("write_dir",write_dir);
         basic.GetInt("write_m",write_m);
+        basic.GetReal("trunc_tol",trunc_tol);
         basic.GetReal("xi",xi);
 
         //Derived parameters
@@ -0,0 +1,219 @@
+#ifndef __SITETERMS_H
+#define __SITETERMS_H
+#include "hams.h"
+#include <map>
+
+//
+// Symbolic form of one MPO site tensor,
+//
+//   W = sum_t coef_t * op_t * row(r_t) * col(c_t)
+//
+// Builders collect the terms first; addTo then writes
+// the link matrix of each operator element by element
+// and adds it to W with one outer product per operator,
+// instead of making a temporary IQTensor per term.
+//
+class SiteTerms
+    {
+    public:
+
+    enum OpType { Id, Sp, Sm, Sz, Sx, ISy, NumOpType };
+
+    struct Term
+        {
+        int row,
+            col;
+        OpType op;
+        Real coef;
+
+        Term(int r, int c, OpType o, Real x) : row(r), col(c), op(o), coef(x) { }
+        };
+
+    SiteTerms() { }
+
+    void
+    add(int r, int c, OpType op, Real coef = 1)
+        {
+        if(coef != 0) terms_.push_back(Term(r,c,op,coef));
+        }
+
+    const std::vector<Term>&
+    terms() const { return terms_; }
+
+    void
+    clear() { terms_.clear(); }
+
+    //Sums terms with the same row, col and operator,
+    //dropping those that cancel, in order of first use
+    void
+    compact();
+
+    //Rewrites the S+S- and S-S+ terms started from channel
+    //start with operators of definite spin flip parity (see
+    //SpinHalfParity): since 0.5(S+S- + S-S+) = SxSx - iSy iSy,
+    //the S+S- half becomes SxSx and the S-S+ half -iSy iSy.
+    //Only valid if both halves carry the same weights.
+    void
+    toParityFrame(int start);
+
+    //W must already have indices conj(si(j)), siP(j), row and col
+    void
+    addTo(IQTensor& W, const Model& model, int j,
+          const IQIndex& row, const IQIndex& col) const
+        { addToImpl(W,model,j,row,col); }
+
+    //Same without quantum numbers: W has indices si(j), siP(j), row and col
+    void
+    addTo(ITensor& W, const Model& model, int j,
+          const Index& row, const Index& col) const
+        { addToImpl(W,model,j,row,col); }
+
+    static IQTensor
+    op(const Model& model, int j, OpType t);
+
+    private:
+
+    std::vector<Term> terms_;
+
+    template<class Tensor, class IndexT>
+    void
+    addToImpl(Tensor& W, const Model& model, int j,
+              const IndexT& row, const IndexT& col) const;
+
+    static void
+    convert(const IQTensor& op, IQTensor& res) { res = op; }
+    static void
+    convert(const IQTensor& op, ITensor& res) { res = op.toITensor(); }
+
+    };
+
+template<class Tensor, class IndexT>
+void inline SiteTerms::
+addToImpl(Tensor& W, const Model& model, int j,
+          const IndexT& row, const IndexT& col) const
+    {
+    std::vector<Tensor> M(NumOpType);
+    std::vector<bool> used(NumOpType,false);
+    for(size_t n = 0; n < terms_.size(); ++n)
+        {
+        const Term& t = terms_[n];
+        if(!used[t.op])
+            {
+            M[t.op] = Tensor(row,col);
+            used[t.op] = true;
+            }
+        M[t.op](row(t.row),col(t.col)) += t.coef;
+        }
+
+    for(int o = 0; o < NumOpType; ++o)
+        {
+        if(!used[o]) continue;
+        Tensor opj;
+        convert(op(model,j,OpType(o)),opj);
+        W += opj * M[o];
+        }
+    }
+
+IQTensor inline SiteTerms::
+op(const Model& model, int j, OpType t)
+    {
+    switch(t)
+        {
+        case Id: return model.id(j);
+        case Sp: return model.sp(j);
+        case Sm: return model.sm(j);
+        case Sz: return model.sz(j);
+        case Sx: return model.sx(j);
+        case ISy: return model.isy(j);
+        default: Error("SiteTerms: unknown operator type");
+        }
+    return IQTensor();
+    }
+
+void inline SiteTerms::
+compact()
+    {
+    std::map<std::pair<std::pair<int,int>,int>,size_t> pos;
+    std::vector<Term> res;
+    for(size_t n = 0; n < terms_.size(); ++n)
+        {
+        const Term& t = terms_[n];
+        const std::pair<std::pair<int,int>,int> key(std::make_pair(t.row,t.col),t.op);
+        std::map<std::pair<std::pair<int,int>,int>,size_t>::const_iterator it = pos.find(key);
+        if(it == pos.end())
+            {
+            pos[key] = res.size();
+            res.push_back(t);
+            }
+        else
+            res[it->second].coef += t.coef;
+        }
+
+    terms_.clear();
+    for(size_t n = 0; n < res.size(); ++n)
+        if(res[n].coef != 0) terms_.push_back(res[n]);
+    }
+
+void inline SiteTerms::
+toParityFrame(int start)
+    {
+    for(size_t n = 0; n < terms_.size(); ++n)
+        {
+        Term& t = terms_[n];
+        if(t.op == Sp)
+            {
+            if(t.row == start)
+                {
+                t.op = Sx;
+                t.coef *= 2;
+                }
+            else
+                t.op = ISy;
+            }
+        else
+        if(t.op == Sm)
+            {
+            if(t.row == start)
+                {
+                t.op = ISy;
+                t.coef *= -2;
+                }
+            else
+                t.op = Sx;
+            }
+        }
+    }
+
+//
+// Builds an MPO without quantum numbers directly from the
+// tables W[1..N], bond i having dims[i] channels; the left
+// edge picks channel start of bond 0, the right one end
+// of bond N. No IQMPO is made along the way.
+//
+void inline
+denseMPO(const Model& model, const std::vector<SiteTerms>& W,
+         const std::vector<int>& dims, int start, int end, MPO& H)
+    {
+    const int N = model.NN();
+    H = MPO(model);
+
+    std::vector<Index> links(N+1);
+    for(int i = 0; i <= N; ++i)
+        links.at(i) = Index(nameint("hl",i),dims.at(i));
+
+    for(int j = 1; j <= N; ++j)
+        {
+        ITensor& Wj = H.AAnc(j);
+        Wj = ITensor(model.si(j),model.siP(j),links.at(j-1),links.at(j));
+        W.at(j).addTo(Wj,model,j,links.at(j-1),links.at(j));
+        }
+
+    ITensor L(links.at(0)),
+            R(links.at(N));
+    L(links.at(0)(start)) = 1;
+    R(links.at(N)(end)) = 1;
+    H.AAnc(1) = L * H.AA(1);
+    H.AAnc(N) = H.AA(N) * R;
+    }
+
+#endif
@@ -0,0 +1,569 @@
+#ifndef __SPARSEMPO_H
+#define __SPARSEMPO_H
+#include "siteterms.h"
+#include "dmrg.h"
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <boost/shared_ptr.hpp>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+//
+// Read-only mapping of a whole file, shared between
+// processes on the same node; data() is 0 if the file
+// could not be mapped
+//
+class MappedFile
+    {
+    public:
+
+    MappedFile(const std::string& fname);
+
+    ~MappedFile();
+
+    const char*
+    data() const { return static_cast<const char*>(data_); }
+
+    size_t
+    size() const { return size_; }
+
+    private:
+
+    void* data_;
+    size_t size_;
+
+    //Not copyable
+    MappedFile(const MappedFile&);
+    void operator=(const MappedFile&);
+
+    };
+
+inline MappedFile::
+MappedFile(const std::string& fname)
+    :
+    data_(0),
+    size_(0)
+    {
+    const int fd = open(fname.c_str(),O_RDONLY);
+    if(fd < 0) return;
+    struct stat st;
+    if(fstat(fd,&st) == 0 && st.st_size > 0)
+        {
+        void* p = mmap(0,st.st_size,PROT_READ,MAP_SHARED,fd,0);
+        if(p != MAP_FAILED)
+            {
+            data_ = p;
+            size_ = st.st_size;
+            }
+        }
+    close(fd);
+    }
+
+inline MappedFile::
+~MappedFile()
+    {
+    if(data_ != 0) munmap(data_,size_);
+    }
+
+//
+// An MPO kept as its term tables: W(j) takes the channels
+// of bond j-1 to those of bond j, the left edge picks
+// channel start() of bond 0 and the right edge channel
+// end() of bond N. The ladder W's are nearly all zeros,
+// so the environments and H*phi are formed channel by
+// channel from the (row,col,op) terms instead of by
+// contracting the full W tensors (see LocalSparseMPO).
+//
+// The terms of all sites sit in one flat array, which
+// write() saves as is; map() then uses a read-only
+// mapping of such a file in place, so jobs sharing a
+// Hamiltonian also share the memory holding it.
+//
+class SparseMPO
+    {
+    public:
+
+    typedef SiteTerms::Term
+    Term;
+
+    SparseMPO() : model_(0), start_(0), end_(0), nterm_(0), terms_(0) { }
+
+    SparseMPO(const Model& model, const std::vector<SiteTerms>& W,
+              int start, int end);
+
+    const Model&
+    model() const { return *model_; }
+
+    int
+    NN() const { return int(off_.size())-2; }
+
+    bool
+    isNull() const { return model_ == 0; }
+
+    int
+    start() const { return start_; }
+    int
+    end() const { return end_; }
+
+    //Terms of site j sorted by (row,op) and by (col,op)
+    const Term*
+    rowBegin(int j) const { return terms_ + off_.at(j); }
+    const Term*
+    rowEnd(int j) const { return terms_ + off_.at(j+1); }
+    const Term*
+    colBegin(int j) const { return terms_ + nterm_ + off_.at(j); }
+    const Term*
+    colEnd(int j) const { return terms_ + nterm_ + off_.at(j+1); }
+
+    const IQTensor&
+    op(int j, SiteTerms::OpType t) const { return op_.at(j).at(t); }
+
+    //Saves the tables under fname along with key (written
+    //to a temporary name first, so readers never see part
+    //of a file)
+    void
+    write(const std::string& fname, const std::string& key) const;
+
+    //Maps a file made by write; false if there is none
+    //or it was made for a different key
+    static bool
+    map(const std::string& fname, const std::string& key,
+        const Model& model, SparseMPO& res);
+
+    private:
+
+    struct Header
+        {
+        char magic[8];
+        int N,
+            start,
+            end,
+            keylen;
+        long nterm;
+        };
+
+    /////////////
+    //
+    // Data Members
+
+    const Model* model_;
+
+    int start_,
+        end_;
+
+    //Site j's terms are [off_[j],off_[j+1]) of the nterm_ sorted
+    //by row, then the same range of the nterm_ sorted by col
+    std::vector<long> off_;
+    long nterm_;
+    const Term* terms_;
+
+    //What terms_ points into
+    boost::shared_ptr<std::vector<Term> > own_;
+    boost::shared_ptr<MappedFile> map_;
+
+    std::vector<std::vector<IQTensor> > op_;
+
+    //
+    /////////////
+
+    void
+    makeOps();
+
+    static const char*
+    magic() { return "SPMPO01"; }
+
+    static long
+    padded(long n) { return (n+7)/8*8; }
+
+    static bool
+    rowLess(const Term& a, const Term& b)
+        { return a.row < b.row || (a.row == b.row && a.op < b.op); }
+    static bool
+    colLess(const Term& a, const Term& b)
+        { return a.col < b.col || (a.col == b.col && a.op < b.op); }
+
+    };
+
+inline SparseMPO::
+SparseMPO(const Model& model, const std::vector<SiteTerms>& W,
+          int start, int end)
+    :
+    model_(&model),
+    start_(start),
+    end_(end),
+    off_(W.size()+1,0),
+    nterm_(0),
+    terms_(0),
+    own_(new std::vector<Term>())
+    {
+    const int N = int(W.size())-1;
+    for(int j = 1; j <= N; ++j)
+        off_.at(j+1) = off_.at(j) + W[j].terms().size();
+    nterm_ = off_.at(N+1);
+
+    std::vector<Term>& t = *own_;
+    t.reserve(2*nterm_);
+    for(int j = 1; j <= N; ++j)
+        {
+        t.insert(t.end(),W[j].terms().begin(),W[j].terms().end());
+        std::stable_sort(t.begin()+off_[j],t.end(),rowLess);
+        }
+    for(int j = 1; j <= N; ++j)
+        {
+        t.insert(t.end(),W[j].terms().begin(),W[j].terms().end());
+        std::stable_sort(t.begin()+nterm_+off_[j],t.end(),colLess);
+        }
+    terms_ = (t.empty() ? 0 : &t[0]);
+
+    makeOps();
+    }
+
+void inline SparseMPO::
+makeOps()
+    {
+    const int N = NN();
+    op_.assign(N+1,std::vector<IQTensor>());
+    for(int j = 1; j <= N; ++j)
+        {
+        op_[j].resize(SiteTerms::NumOpType);
+        for(const Term* t = rowBegin(j); t != rowEnd(j); ++t)
+            {
+            IQTensor& o = op_[j].at(t->op);
+            if(o.isNull()) o = SiteTerms::op(*model_,j,t->op);
+            }
+        }
+    }
+
+void inline SparseMPO::
+write(const std::string& fname, const std::string& key) const
+    {
+    Header h;
+    std::memset(&h,0,sizeof(h));
+    std::strncpy(h.magic,magic(),sizeof(h.magic));
+    h.N = NN();
+    h.start = start_;
+    h.end = end_;
+    h.keylen = key.size();
+    h.nterm = nterm_;
+
+    const std::string tmpname = (boost::format("%s.%d.%p") % fname % getpid() % this).str();
+    std::ofstream s(tmpname.c_str(),std::ios::binary);
+    s.write((const char*) &h,sizeof(h));
+    std::vector<char> kbuf(padded(key.size()),0);
+    std::copy(key.begin(),key.end(),kbuf.begin());
+    if(!kbuf.empty()) s.write(&kbuf[0],kbuf.size());
+    s.write((const char*) &off_[0],off_.size()*sizeof(long));
+    if(nterm_ > 0) s.write((const char*) terms_,2*nterm_*sizeof(Term));
+    s.close();
+    if(!s) Error("SparseMPO: could not write " + tmpname);
+    rename(tmpname.c_str(),fname.c_str());
+    }
+
+bool inline SparseMPO::
+map(const std::string& fname, const std::string& key,
+    const Model& model, SparseMPO& res)
+    {
+    boost::shared_ptr<MappedFile> mf(new MappedFile(fname));
+    const char* p = mf->data();
+    if(p == 0 || mf->size() < sizeof(Header)) return false;
+
+    const Header& h = *reinterpret_cast<const Header*>(p);
+    if(std::strncmp(h.magic,magic(),sizeof(h.magic)) != 0) return false;
+    if(h.N != model.NN() || h.keylen != int(key.size())) return false;
+    p += sizeof(Header);
+    if(std::string(p,h.keylen) != key) return false;
+    p += padded(h.keylen);
+
+    const size_t need = sizeof(Header) + padded(h.keylen) 
+                        + (h.N+2)*sizeof(long) + 2*h.nterm*sizeof(Term);
+    if(mf->size() != need) return false;
+
+    res = SparseMPO();
+    res.model_ = &model;
+    res.start_ = h.start;
+    res.end_ = h.end;
+    res.off_.assign(reinterpret_cast<const long*>(p),reinterpret_cast<const long*>(p)+h.N+2);
+    p += (h.N+2)*sizeof(long);
+    res.nterm_ = h.nterm;
+    res.terms_ = reinterpret_cast<const Term*>(p);
+    res.map_ = mf;
+    res.makeOps();
+    return true;
+    }
+
+//
+// Projected Hamiltonian of a SparseMPO for two-site DMRG,
+// usable by DMRGWorker in place of LocalMPO. Each edge
+// environment is kept as one (link,link') tensor per
+// channel that is actually reached, and applying a site
+// multiplies each such tensor by each of its operators
+// once, then adds the products into the channels they
+// feed with the term coefficients.
+//
+// diag() and deltaRho() return null tensors: use no
+// noise term with a SparseMPO (tladder's setupOpts sets
+// the noise of the sweeps to zero).
+//
+class LocalSparseMPO
+    {
+    public:
+
+    typedef std::map<int,IQTensor>
+    Channels;
+
+    LocalSparseMPO(const SparseMPO& H)
+        :
+        H_(H),
+        L_(H.NN()+2),
+        R_(H.NN()+2),
+        LHlim_(0),
+        RHlim_(H.NN()+1),
+        b_(1),
+        size_(0)
+        { }
+
+    template <class MPSType>
+    void
+    position(int b, const MPSType& psi);
+
+    void
+    product(const IQTensor& phi, IQTensor& phip) const;
+
+    Real
+    expect(const IQTensor& phi) const;
+
+    IQTensor
+    deltaRho(const IQTensor& rho, const IQCombiner& comb, Direction dir) const
+        { return IQTensor(); }
+
+    IQTensor
+    diag() const { return IQTensor(); }
+
+    //Dimension of the two-site space at the current bond,
+    //which caps the Davidson iterations as for LocalOp
+    int
+    size() const { return size_; }
+
+    //Number of H*phi products made by all LocalSparseMPOs
+    //so far, about one per Davidson iteration (see TopOpts)
+    static long&
+    nproduct() { static long n = 0; return n; }
+
+    bool
+    isNull() const { return H_.isNull(); }
+
+    //Environments are always kept in memory
+    bool
+    doWrite() const { return false; }
+    void
+    doWrite(bool val) { }
+
+    private:
+
+    /////////////
+    //
+    // Data Members
+
+    const SparseMPO& H_;
+
+    //L_[j]: sites 1..j, keyed by the channels of bond j
+    //R_[j]: sites j..N, keyed by the channels of bond j-1
+    std::vector<Channels> L_,
+                          R_;
+
+    int LHlim_,
+        RHlim_,
+        b_,
+        size_;
+
+    //
+    /////////////
+
+    //out[c'] = sum over terms (c,c',op) of coef*in[c]*op (fromLeft)
+    //or over terms (c',c,op) (!fromLeft) at site j
+    void
+    apply(int j, bool fromLeft, const Channels& in, Channels& out) const;
+
+    template <class MPSType>
+    void
+    makeL(int j, const MPSType& psi);
+
+    template <class MPSType>
+    void
+    makeR(int j, const MPSType& psi);
+
+    };
+
+template <class MPSType>
+void inline LocalSparseMPO::
+position(int b, const MPSType& psi)
+    {
+    while(LHlim_ < b-1)
+        {
+        makeL(LHlim_+1,psi);
+        ++LHlim_;
+        }
+    LHlim_ = b-1;
+
+    while(RHlim_ > b+2)
+        {
+        makeR(RHlim_-1,psi);
+        --RHlim_;
+        }
+    RHlim_ = b+2;
+
+    b_ = b;
+
+    //Product of the sizes of the indices of psi.AA(b)*psi.AA(b+1)
+    const IQTensor& A = psi.AA(b);
+    const IQTensor& B = psi.AA(b+1);
+    long s = 1;
+    for(int i = 1; i <= A.r(); ++i)
+        s *= A.index(i).m();
+    for(int i = 1; i <= B.r(); ++i)
+        {
+        const IQIndex& I = B.index(i);
+        if(A.hasindex(I)) s /= I.m();
+        else              s *= I.m();
+        }
+    size_ = int(s);
+    }
+
+void inline LocalSparseMPO::
+apply(int j, bool fromLeft, const Channels& in, Channels& out) const
+    {
+    out.clear();
+    const SparseMPO::Term* t = (fromLeft ? H_.rowBegin(j) : H_.colBegin(j));
+    const SparseMPO::Term* tend = (fromLeft ? H_.rowEnd(j) : H_.colEnd(j));
+    const SparseMPO::Term* n = t;
+    while(n != tend)
+        {
+        const int c = (fromLeft ? n->row : n->col);
+        const SiteTerms::OpType op = n->op;
+        const SparseMPO::Term* m = n;
+        while(m != tend && (fromLeft ? m->row : m->col) == c && m->op == op)
+            ++m;
+
+        Channels::const_iterator it = in.find(c);
+        if(it != in.end())
+            {
+            const IQTensor x = it->second * H_.op(j,op);
+            for(const SparseMPO::Term* q = n; q != m; ++q)
+                {
+                const int c2 = (fromLeft ? q->col : q->row);
+                IQTensor y = x;
+                if(q->coef != 1) y *= q->coef;
+                Channels::iterator o = out.find(c2);
+                if(o == out.end()) out[c2] = y;
+                else o->second += y;
+                }
+            }
+        n = m;
+        }
+    }
+
+template <class MPSType>
+void inline LocalSparseMPO::
+makeL(int j, const MPSType& psi)
+    {
+    Channels in, out;
+    if(j == 1)
+        in[H_.start()] = psi.AA(1);
+    else
+        {
+        for(Channels::const_iterator it = L_.at(j-1).begin(); it != L_.at(j-1).end(); ++it)
+            in[it->first] = it->second * psi.AA(j);
+        }
+    apply(j,true,in,out);
+
+    const IQTensor bra = conj(primed(psi.AA(j)));
+    Channels& L = L_.at(j);
+    L.clear();
+    for(Channels::const_iterator it = out.begin(); it != out.end(); ++it)
+        L[it->first] = it->second * bra;
+    }
+
+template <class MPSType>
+void inline LocalSparseMPO::
+makeR(int j, const MPSType& psi)
+    {
+    const int N = H_.NN();
+    Channels in, out;
+    if(j == N)
+        in[H_.end()] = psi.AA(N);
+    else
+        {
+        for(Channels::const_iterator it = R_.at(j+1).begin(); it != R_.at(j+1).end(); ++it)
+            in[it->first] = it->second * psi.AA(j);
+        }
+    apply(j,false,in,out);
+
+    const IQTensor bra = conj(primed(psi.AA(j)));
+    Channels& R = R_.at(j);
+    R.clear();
+    for(Channels::const_iterator it = out.begin(); it != out.end(); ++it)
+        R[it->first] = it->second * bra;
+    }
+
+void inline LocalSparseMPO::
+product(const IQTensor& phi, IQTensor& phip) const
+    {
+    const int N = H_.NN();
+    ++nproduct();
+
+    Channels in, mid, out;
+    if(b_ == 1)
+        in[H_.start()] = phi;
+    else
+        {
+        for(Channels::const_iterator it = L_.at(b_-1).begin(); it != L_.at(b_-1).end(); ++it)
+            in[it->first] = it->second * phi;
+        }
+
+    apply(b_,true,in,mid);
+    apply(b_+1,true,mid,out);
+
+    phip = IQTensor();
+    if(b_+1 == N)
+        {
+        Channels::const_iterator it = out.find(H_.end());
+        if(it != out.end()) phip = it->second;
+        }
+    else
+        {
+        const Channels& R = R_.at(b_+2);
+        for(Channels::const_iterator it = out.begin(); it != out.end(); ++it)
+            {
+            Channels::const_iterator r = R.find(it->first);
+            if(r == R.end()) continue;
+            if(phip.isNull()) phip = it->second * r->second;
+            else phip += it->second * r->second;
+            }
+        }
+    phip.noprime();
+    }
+
+Real inline LocalSparseMPO::
+expect(const IQTensor& phi) const
+    {
+    IQTensor phip;
+    product(phi,phip);
+    return Dot(conj(phi),phip);
+    }
+
+//
+// DMRG with a SparseMPO Hamiltonian
+//
+Real inline
+dmrg(IQMPS& psi, const SparseMPO& H, const Sweeps& sweeps, DMRGObserver& obs,
+     const Option& opt1 = Option(), const Option& opt2 = Option())
+    {
+    LocalSparseMPO PH(H);
+    return DMRGWorker(psi,sweeps,obs,PH,OptionSet(opt1,opt2));
+    }
+
+#endif
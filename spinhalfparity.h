@@ -0,0 +1,194 @@
+#ifndef __SPINHALFPARITY_H
+#define __SPINHALFPARITY_H
+#include "model.h"
+
+//
+// Spin 1/2 sites in the Sx eigenbasis, Right = |+x> and
+// Left = |-x>, with the spin flip parity prod_j 2Sx_j as the
+// conserved quantum number (the fermion parity slot of QN;
+// sz and Nf are always zero). Sx and Id are parity even,
+// Sz and iSy (= i*Sy) parity odd. S+ and S- have no definite
+// parity in this basis, so Hamiltonians for this model must
+// be written with Sx, iSy and Sz: 0.5(S+S- + S-S+) is
+// SxSx - iSy iSy. This is the symmetry left over when an
+// Sx pinning field breaks Sz conservation.
+//
+class SpinHalfParity : public Model
+    {
+    public:
+
+    SpinHalfParity();
+
+    SpinHalfParity(int N);
+
+    SpinHalfParity(std::ifstream& s) { doRead(s); }
+
+    IQIndexVal
+    Right(int i) const;
+
+    IQIndexVal
+    Left(int i) const;
+
+    IQIndexVal
+    RightP(int i) const;
+
+    IQIndexVal
+    LeftP(int i) const;
+
+    private:
+
+    virtual int
+    getNN() const { return N_; }
+
+    virtual const IQIndex&
+    getSi(int i) const { return site_.at(i); }
+
+    virtual IQIndex
+    getSiP(int i) const { return primed(site_.at(i)); }
+
+    virtual IQTensor
+    makeTReverse(int i) const { Error("makeTReverse not implemented"); return IQTensor(); }
+
+    virtual IQTensor
+    makeId(int i) const;
+
+    virtual IQTensor
+    makeSz(int i) const;
+
+    virtual IQTensor
+    makeSx(int i) const;
+
+    virtual IQTensor
+    makeISy(int i) const;
+
+    virtual IQTensor
+    makeSp(int i) const { Error("S+ has no definite parity"); return IQTensor(); }
+
+    virtual IQTensor
+    makeSm(int i) const { Error("S- has no definite parity"); return IQTensor(); }
+
+    virtual void
+    doRead(std::istream& s);
+
+    virtual void
+    doWrite(std::ostream& s) const;
+
+    virtual void
+    constructSites();
+
+    /////////////
+    //
+    // Data Members
+
+    int N_;
+
+    std::vector<IQIndex> site_;
+
+    //
+    /////////////
+
+    };
+
+inline SpinHalfParity::
+SpinHalfParity()
+    : N_(-1)
+    { }
+
+inline SpinHalfParity::
+SpinHalfParity(int N)
+    : N_(N),
+      site_(N_+1)
+    {
+    constructSites();
+    }
+
+void inline SpinHalfParity::
+constructSites()
+    {
+    for(int j = 1; j <= N_; ++j)
+        {
+        site_.at(j) = IQIndex(nameint("S=1/2 Sx basis, site=",j),
+                              Index(nameint("Right for site",j),1,Site),QN(0,0,0),
+                              Index(nameint("Left for site",j),1,Site),QN(0,0,1));
+        }
+    }
+
+void inline SpinHalfParity::
+doRead(std::istream& s)
+    {
+    s.read((char*) &N_,sizeof(N_));
+    site_.resize(N_+1);
+    for(int j = 1; j <= N_; ++j)
+        site_.at(j).read(s);
+    }
+
+void inline SpinHalfParity::
+doWrite(std::ostream& s) const
+    {
+    s.write((char*) &N_,sizeof(N_));
+    for(int j = 1; j <= N_; ++j)
+        site_.at(j).write(s);
+    }
+
+inline IQIndexVal SpinHalfParity::
+Right(int i) const
+    {
+    return getSi(i)(1);
+    }
+
+inline IQIndexVal SpinHalfParity::
+Left(int i) const
+    {
+    return getSi(i)(2);
+    }
+
+inline IQIndexVal SpinHalfParity::
+RightP(int i) const
+    {
+    return getSiP(i)(1);
+    }
+
+inline IQIndexVal SpinHalfParity::
+LeftP(int i) const
+    {
+    return getSiP(i)(2);
+    }
+
+inline IQTensor SpinHalfParity::
+makeId(int i) const
+    {
+    IQTensor Id(conj(si(i)),siP(i));
+    Id(Right(i),RightP(i)) = 1;
+    Id(Left(i),LeftP(i)) = 1;
+    return Id;
+    }
+
+inline IQTensor SpinHalfParity::
+makeSx(int i) const
+    {
+    IQTensor Sx(conj(si(i)),siP(i));
+    Sx(Right(i),RightP(i)) = +0.5;
+    Sx(Left(i),LeftP(i)) = -0.5;
+    return Sx;
+    }
+
+inline IQTensor SpinHalfParity::
+makeSz(int i) const
+    {
+    IQTensor Sz(conj(si(i)),siP(i));
+    Sz(Right(i),LeftP(i)) = 0.5;
+    Sz(Left(i),RightP(i)) = 0.5;
+    return Sz;
+    }
+
+//<+x|iSy|-x> = -1/2, <-x|iSy|+x> = +1/2
+inline IQTensor SpinHalfParity::
+makeISy(int i) const
+    {
+    IQTensor ISy(conj(si(i)),siP(i));
+    ISy(Left(i),RightP(i)) = -0.5;
+    ISy(Right(i),LeftP(i)) = +0.5;
+    return ISy;
+    }
+
+#endif
@@ -0,0 +1,147 @@
+#ifndef __TASKPOOL_H
+#define __TASKPOOL_H
+#include <pthread.h>
+#include <exception>
+#include <string>
+#include <vector>
+
+class Task
+    {
+    public:
+
+    virtual
+    ~Task() { }
+
+    void virtual
+    run() = 0;
+
+    };
+
+//
+// Runs a handful of independent Tasks on up to
+// nthreads threads (the calling thread included).
+// Tasks are claimed in the order they were added;
+// run() returns once all of them are done. A task
+// throwing doesn't stop the others: run() then fails
+// with the messages of every task that threw, the same
+// with one thread as with several.
+//
+class TaskPool
+    {
+    public:
+
+    TaskPool(int nthreads = 1)
+        :
+        nthreads_(nthreads),
+        next_(0)
+        { }
+
+    void
+    add(Task& t) { tasks_.push_back(&t); }
+
+    void
+    run();
+
+    private:
+
+    /////////////
+    //
+    // Data Members
+
+    int nthreads_;
+
+    std::vector<Task*> tasks_;
+
+    size_t next_;
+    std::string errors_;
+
+    pthread_mutex_t mutex_;
+
+    //
+    /////////////
+
+    Task*
+    claim();
+
+    void
+    work();
+
+    static void*
+    startWorker(void* pool);
+
+    };
+
+void inline TaskPool::
+run()
+    {
+    const int nworkers = (nthreads_ < int(tasks_.size()) ? nthreads_ : int(tasks_.size()));
+
+    next_ = 0;
+    errors_.clear();
+    pthread_mutex_init(&mutex_,NULL);
+
+    std::vector<pthread_t> threads(nworkers > 1 ? nworkers-1 : 0);
+    int nstarted = 0;
+    for(; nstarted < int(threads.size()); ++nstarted)
+        {
+        if(pthread_create(&threads[nstarted],NULL,&TaskPool::startWorker,this) != 0)
+            break;
+        }
+
+    work();
+
+    for(int t = 0; t < nstarted; ++t)
+        pthread_join(threads[t],NULL);
+
+    pthread_mutex_destroy(&mutex_);
+    tasks_.clear();
+
+    if(!errors_.empty())
+        Error("TaskPool: " + errors_);
+    }
+
+inline Task* TaskPool::
+claim()
+    {
+    Task* t = 0;
+    pthread_mutex_lock(&mutex_);
+    if(next_ < tasks_.size())
+        t = tasks_[next_++];
+    pthread_mutex_unlock(&mutex_);
+    return t;
+    }
+
+void inline TaskPool::
+work()
+    {
+    while(Task* t = claim())
+        {
+        std::string err;
+        try
+            {
+            t->run();
+            }
+        catch(const std::exception& e)
+            {
+            err = e.what();
+            }
+        catch(...)
+            {
+            err = "a task failed";
+            }
+        if(err.empty()) continue;
+        pthread_mutex_lock(&mutex_);
+        if(!errors_.empty()) errors_ += "; ";
+        errors_ += err;
+        pthread_mutex_unlock(&mutex_);
+        }
+    }
+
+inline void* TaskPool::
+startWorker(void* pool)
+    {
+    static_cast<TaskPool*>(pool)->work();
+    return NULL;
+    }
+
+#endif
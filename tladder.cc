@@ -7,7 +7,15 @@
 #include "fitting.h"
 #include "LongRangeSpinLadder.h"
 #include "NNSpinLadder.h"
+#include "TruncatedSpinLadder.h"
+#include "spinhalfparity.h"
 #include "topopts.h"
+#include "measure.h"
+#include "taskpool.h"
+#include <cstdio>
+#include <sstream>
+#include <unistd.h>
+#include <boost/scoped_ptr.hpp>
 using boost::format;
 using namespace std;
 
@@ -34,13 +42,20 @@ class Dipole : public Callable
     virtual
     ~Dipole() { }
 
+    //Non-virtual so that templated fits can inline it
+    Real
+    operator()(Real d) const
+        {
+        return 1./(d*d*d);
+        }
+
     private: 
 
     Real virtual
-    call(Real d) const
-        {
-        return 1./pow(d,3);
-        }
+    call(Real d) const { return operator()(d); }
+
+    std::string virtual
+    getKey() const { return "dipole"; }
 
     };
 
@@ -56,16 +71,23 @@ class InterLeg : public Callable
     virtual
     ~InterLeg() { }
 
+    Real
+    operator()(Real d) const
+        {
+        Real x = (d-1);
+        Real r2 = x*x+1;
+        return 1./(r2*sqrt(r2))*(1-(1-Lambda_)/r2);
+        }
+
     private: 
 
     Real Lambda_;
 
     Real virtual
-    call(Real d) const
-        {
-        Real x = (d-1);
-        return 1./pow(x*x+1,1.5)*(1-(1-Lambda_)/(x*x+1));
-        }
+    call(Real d) const { return operator()(d); }
+
+    std::string virtual
+    getKey() const { return (format("interleg%.12g") % Lambda_).str(); }
 
     };
 
@@ -85,17 +107,20 @@ class TanhSmoothing : public Callable
     virtual
     ~TanhSmoothing() { }
 
+    Real
+    operator()(Real j) const
+        {
+        Real dj = 2+(j < nx_/2 ? (j-1) : nx_-j);
+        return y(1-dj/xi_);
+        }
+
     private:
 
     Real nx_,
          xi_;
 
     Real
-    call(Real j) const
-        {
-        Real dj = 2+(j < nx_/2 ? (j-1) : nx_-j);
-        return y(1-dj/xi_);
-        }
+    call(Real j) const { return operator()(j); }
 
     Real
     y(Real x) const
@@ -110,177 +135,609 @@ class TanhSmoothing : public Callable
 
     };
 
-template<class Tensor>
+//Every mode depends on fit_reltol: it sets the tolerance,
+//picks the best candidate and weighs the refinement
+string
+fitMethod()
+    {
+    string method = "fixed";
+    if(params.fit_tol > 0)
+        method = (format("tol%.6E") % params.fit_tol).str();
+    else if(params.p < 0)
+        method = "auto";
+    method += (params.fit_reltol ? "rel" : "abs");
+    if(params.fit_refine)
+        method += "_lm";
+    return method;
+    }
+
+//With fit_tol set, take the cheapest fit meeting the tolerance
+//instead of the most accurate one
+Option
+fitMode()
+    {
+    if(params.fit_tol > 0)
+        return FitTolerance(params.fit_tol);
+    return Auto(params.p < 0);
+    }
+
+//Writes under a temporary name and renames, since
+//other fits or jobs may be after the same file
+template<class T>
 void
-makeLongRangeH(const Model& model, MPOt<Tensor>& H)
+writeCache(const string& fname, const T& t)
+    {
+    const string tmpname = (format("%s.%d.%p") % fname % getpid() % &t).str();
+    writeToFile(tmpname,t);
+    rename(tmpname.c_str(),fname.c_str());
+    }
+
+//
+// With fit_cache, fits of functions with a key are
+// cached on disk, next to the model file, under a
+// name recording the function, nx, the maximum (or
+// fixed) number of exponentials and how that number
+// was chosen
+//
+template<class Function>
+ExpFit
+makeFit(const Function& f, int nx, int nexp)
+    {
+    const string fname = (format("fit_%s_%d_%d_%s") % f.key() % nx % nexp % fitMethod()).str();
+    const bool use_cache = (params.fit_cache && f.key() != "");
+
+    ExpFit fit;
+    if(use_cache && fexist(fname))
+        {
+        cout << "Reading fit " << fname << " from disk." << endl;
+        readFromFile(fname,fit);
+        fit.callable(f);
+        return fit;
+        }
+
+    fit = ExpFit(f,nx,nexp,fitMode(),RelativeTolerance(params.fit_reltol),Quiet(),
+                 RefineFit(params.fit_refine));
+
+    if(use_cache)
+        {
+        cout << "Writing fit " << fname << " to disk." << endl;
+        writeCache(fname,fit);
+        }
+
+    return fit;
+    }
+
+//Reads and writes a set of fits as one file
+class FitSet
+    {
+    public:
+
+    FitSet(const std::vector<ExpFit*>& fits) : fits_(fits) { }
+
+    void
+    read(std::istream& s) 
+        { 
+        for(size_t n = 0; n < fits_.size(); ++n) 
+            fits_[n]->read(s); 
+        }
+
+    void
+    write(std::ostream& s) const
+        { 
+        for(size_t n = 0; n < fits_.size(); ++n) 
+            fits_[n]->write(s); 
+        }
+
+    private:
+
+    std::vector<ExpFit*> fits_;
+
+    };
+
+//
+// Fits f1, f2 and f3 with one shared set of lambdas
+// (see ExpFit::fitJointly), cached like makeFit
+//
+template<class F1, class F2, class F3>
+void
+makeJointFits(const F1& f1, const F2& f2, const F3& f3, int nx, int nexp,
+              ExpFit& fit1, ExpFit& fit2, ExpFit& fit3)
+    {
+    const string fname = (format("fit_joint_%s_%s_%s_%d_%d_%s") 
+                          % f1.key() % f2.key() % f3.key() % nx % nexp % fitMethod()).str();
+    const bool use_cache = (params.fit_cache && f1.key() != "" && f2.key() != "" && f3.key() != "");
+
+    fit1 = ExpFit(f1,nx);
+    fit2 = ExpFit(f2,nx);
+    fit3 = ExpFit(f3,nx);
+
+    std::vector<ExpFit*> fits;
+    fits.push_back(&fit1);
+    fits.push_back(&fit2);
+    fits.push_back(&fit3);
+    FitSet set(fits);
+
+    if(use_cache && fexist(fname))
+        {
+        cout << "Reading joint fit " << fname << " from disk." << endl;
+        readFromFile(fname,set);
+        return;
+        }
+
+    ExpFit::fitJointly(fits,nexp,fitMode(),RelativeTolerance(params.fit_reltol),Quiet(),
+                       RefineFit(params.fit_refine));
+
+    if(use_cache)
+        {
+        cout << "Writing joint fit " << fname << " to disk." << endl;
+        writeCache(fname,set);
+        }
+    }
+
+int
+numThreads()
+    {
+    int nt = atoi(params.nthreads.c_str());
+    return (nt > 0 ? nt : 1);
+    }
+
+//
+// Computes one interaction fit, then its diagnostics:
+// a stats() report with the fit's warnings, kept for
+// the caller to print,
+// and the *_V2 data files. Fits are independent of
+// each other so these can run concurrently.
+//
+template<class Function>
+class FitTask : public Task
+    {
+    public:
+
+    FitTask(const string& name, const string& prefix,
+            const Function& f, int nx, int nexp)
+        :
+        name_(name),
+        prefix_(prefix),
+        f_(f),
+        nx_(nx),
+        nexp_(nexp),
+        fitted_(false)
+        { }
+
+    virtual
+    ~FitTask() { }
+
+    const ExpFit&
+    fit() const { return fit_; }
+
+    //Use fit instead of computing one; run()
+    //then only does the diagnostics
+    void
+    fit(const ExpFit& f) { fit_ = f; fitted_ = true; }
+
+    const string&
+    report() const { return report_; }
+
+    void virtual
+    run()
+        {
+        if(!fitted_)
+            fit_ = makeFit(f_,nx_,nexp_);
+
+        Real avgdiff = 0.0;
+        Real maxdiff = -1.0;
+        int maxdiff_pos = -1;
+        bool lambda_is_real = true;
+
+        fit_.stats(lambda_is_real,maxdiff,maxdiff_pos,avgdiff);
+        std::ostringstream oh;
+        oh << name_ << " fit:" << endl;
+        oh << "    Number of exponentials = " << fit_.nexp() << endl;
+        oh << "    Number of channels = " << fit_.nchannel() << endl;
+        oh << "    maxdiff = " << format("%.3E") % maxdiff << ", at " << maxdiff_pos << endl;
+        oh << "    avgdiff = " << format("%.3E") % avgdiff << endl;
+
+        Vector fitted_V2, exact_V2(nx_);
+        fit_.evaluate(fitted_V2,nx_);
+        oh << fit_.warnings() << endl;
+        report_ = oh.str();
+
+        for(int j = 1; j <= nx_; ++j) 
+            exact_V2(j) = f_(j);
+        writedata(prefix_+"fitted_V2",fitted_V2,1,params.do_plot_self);
+        writedata(prefix_+"exact_V2",exact_V2,1,params.do_plot_self);
+        Vector V2_diff = exact_V2-fitted_V2;
+        writedata(prefix_+"V2_diff",V2_diff,1,params.do_plot_self);
+        }
+
+    private:
+
+    string name_,
+           prefix_;
+    const Function& f_;
+    int nx_,
+        nexp_;
+
+    ExpFit fit_;
+    bool fitted_;
+    string report_;
+
+    };
+
+//Every parameter the long range Hamiltonian depends on but LambdaXY
+string
+modelKey(bool parity)
+    {
+    return (format("nx=%d LambdaZ=%.12g nn=%d fit=%s p=%d max_p=%d max_p_leg=%d max_p_rung=%d "
+                   "joint_fit=%d pinning=%.12g stagger_pinning=%d smooth=%d xi=%.12g interaction_cutoff=%d "
+                   "compress_mpo=%d compress_tol=%.12g parity=%d") 
+            % params.nx % params.LambdaZ % params.nn % fitMethod() 
+            % params.p % params.max_p % params.max_p_leg % params.max_p_rung 
+            % params.joint_fit % params.pinning % params.stagger_pinning % params.smooth % params.xi 
+            % params.interaction_cutoff % params.compress_mpo % params.compress_tol % parity).str();
+    }
+
+//
+// Makes the long range Hamiltonian for the current params
+// (MPOType can be an IQMPO, MPO or SparseMPO; parity is for
+// a SpinHalfParity model). The fits and the MPO builder are
+// kept between calls: if only LambdaXY changed, as in a
+// parameter sweep, just the rung XY fit is redone and the
+// builder rewrites the rung XY terms of the MPO it made
+// before (see LongRangeSpinLadder::updateFitXY). When it
+// can't, the MPO is made anew from the leg and Z fits kept.
+//
+class LongRangeH
+    {
+    public:
+
+    LongRangeH() : model_(0), LambdaXY_(0) { }
+
+    template<class MPOType>
+    void
+    make(const Model& model, MPOType& H, bool parity = false);
+
+    private:
+
+    const Model* model_;
+    string key_;
+    Real LambdaXY_;
+    ExpFit fit_,
+           fitXY_,
+           fitZ_;
+    boost::scoped_ptr<LongRangeSpinLadder> builder_;
+
+    void
+    makeFits();
+
+    void
+    makeBuilder(const Model& model, bool parity);
+
+    };
+
+template<class MPOType>
+void LongRangeH::
+make(const Model& model, MPOType& H, bool parity)
     {
     if(params.nn)
         Error("NN Hamiltonian requested");
 
+    //Exact couplings up to a range, no fits needed
+    if(params.interaction_cutoff > -1)
+        {
+        if(parity)
+            Error("Truncated range model not supported with spin flip parity");
+        cout << "\nUsing truncated range model.\n" << endl;
+        Option pin;
+        if(params.pinning != 0)
+            pin = Pinning(params.pinning);
+        H = TruncatedSpinLadder(model,params.LambdaXY,params.LambdaZ,params.interaction_cutoff,pin,
+                                StaggerPinning(params.stagger_pinning));
+        return;
+        }
+
+    const string key = modelKey(parity);
+    if(builder_ && model_ == &model && key == key_ && !params.joint_fit)
+        {
+        if(params.LambdaXY != LambdaXY_)
+            {
+            //Only the rung XY fit depends on LambdaXY
+            const int nx = params.nx;
+            const int p = params.p;
+            const int max_p_rung = (params.max_p_rung == -1 ? params.max_p : params.max_p_rung);
+            InterLeg lxy(params.LambdaXY);
+            FitTask<InterLeg> xytask("XY","XY_",lxy,nx,(p < 0 ? max_p_rung : p));
+            xytask.run();
+            fitXY_ = xytask.fit();
+            LambdaXY_ = params.LambdaXY;
+            cout << xytask.report();
+
+            if(builder_->updateFitXY())
+                cout << "\nUpdated the rung XY terms of the long range model.\n" << endl;
+            else
+                makeBuilder(model,parity);
+            }
+        H = *builder_;
+        return;
+        }
+
+    makeFits();
+    model_ = &model;
+    key_ = key;
+    LambdaXY_ = params.LambdaXY;
+    makeBuilder(model,parity);
+    H = *builder_;
+    }
+
+void LongRangeH::
+makeFits()
+    {
     const int nx = params.nx;
-    const int N = 2*nx; //2 leg ladder
     const Real LambdaXY = params.LambdaXY;
     const Real LambdaZ = params.LambdaZ;
 
-    TanhSmoothing smoothing(nx,params.xi);
-
-    //
-    // Compute long range fits
-    //
-    ExpFit fit,fitXY,fitZ;
-
     int p = params.p;
     int max_p_leg = (params.max_p_leg == -1 ? params.max_p : params.max_p_leg);
     int max_p_rung = (params.max_p_rung == -1 ? params.max_p : params.max_p_rung);
 
     Dipole f;
-    fit = ExpFit(f,nx,(p < 0 ? max_p_leg : p),Auto(p < 0),Quiet());
-
     InterLeg lxy(LambdaXY);
-    fitXY = ExpFit(lxy,nx,(p < 0 ? max_p_rung : p),Auto(p < 0),Quiet());
-
     InterLeg lz(LambdaZ);
-    fitZ = ExpFit(lz,nx,(p < 0 ? max_p_rung : p),Auto(p < 0),Quiet());
-    Real totZ1 = 0, totZ2 = 0;
-    for(int n = 1; n <= fitZ.ReChi().Length(); ++n)
-        {
-        totZ1 += fitZ.ReChi()(n);
-        totZ2 += fitZ.ReChi()(n)*fitZ.ReLambda()(n);
-        }
-    //cout << format("LambdaZ = %.10f, totZ1 = %.10f, totZ2 = %.10f\n") % LambdaZ % totZ1 % totZ2 << endl;
 
-    Real avgdiff = 0.0;
-    Real maxdiff = -1.0;
-    int maxdiff_pos = -1;
-    bool lambda_is_real = true;
-
-    fit.stats(lambda_is_real,maxdiff,maxdiff_pos,avgdiff);
-    cout << "Dipole fit:" << endl;
-    cout << "    Number of exponentials = " << fit.nexp() << endl;
-    cout << "    maxdiff = " << format("%.3E") % maxdiff << ", at " << maxdiff_pos << endl;
-    cout << "    avgdiff = " << format("%.3E") % avgdiff << endl;
-    cout << endl;
-
-    fitXY.stats(lambda_is_real,maxdiff,maxdiff_pos,avgdiff);
-    cout << "XY fit:" << endl;
-    cout << "    Number of exponentials = " << fitXY.nexp() << endl;
-    cout << "    maxdiff = " << format("%.3E") % maxdiff << ", at " << maxdiff_pos << endl;
-    cout << "    avgdiff = " << format("%.3E") % avgdiff << endl;
-    cout << endl;
-
-    fitZ.stats(lambda_is_real,maxdiff,maxdiff_pos,avgdiff);
-    cout << "Z fit:" << endl;
-    cout << "    Number of exponentials = " << fitZ.nexp() << endl;
-    cout << "    maxdiff = " << format("%.3E") % maxdiff << ", at " << maxdiff_pos << endl;
-    cout << "    avgdiff = " << format("%.3E") % avgdiff << endl;
-    cout << endl;
-
-    Vector fitted_V2(nx), exact_V2(nx);
-        {
-        for(int j = 1; j <= nx; ++j) 
-            {
-            fitted_V2(j) = fit(j);
-            exact_V2(j) = f(j);
-            }
-        writedata("fitted_V2",fitted_V2,1,params.do_plot_self);
-        writedata("exact_V2",exact_V2,1,params.do_plot_self);
-        Vector V2_diff = exact_V2-fitted_V2;
-        writedata("V2_diff",V2_diff,1,params.do_plot_self);
-        }
+    FitTask<Dipole> legtask("Dipole","",f,nx,(p < 0 ? max_p_leg : p));
+    FitTask<InterLeg> xytask("XY","XY_",lxy,nx,(p < 0 ? max_p_rung : p));
+    FitTask<InterLeg> ztask("Z","Z_",lz,nx,(p < 0 ? max_p_rung : p));
 
+    //One set of lambdas for all three interactions
+    //lets LongRangeSpinLadder share channels between
+    //leg and rung terms; only the diagnostics are left
+    //for the tasks to do. The shared lambdas serve both
+    //leg and rung, so they may use the larger limit
+    if(params.joint_fit)
         {
-        for(int j = 1; j <= nx; ++j) 
-            {
-            fitted_V2(j) = fitXY(j);
-            exact_V2(j) = lxy(j);
-            }
-        writedata("XY_fitted_V2",fitted_V2,1,params.do_plot_self);
-        writedata("XY_exact_V2",exact_V2,1,params.do_plot_self);
-        Vector V2_diff = exact_V2-fitted_V2;
-        writedata("XY_V2_diff",V2_diff,1,params.do_plot_self);
+        makeJointFits(f,lxy,lz,nx,(p < 0 ? max(max_p_leg,max_p_rung) : p),fit_,fitXY_,fitZ_);
+        legtask.fit(fit_);
+        xytask.fit(fitXY_);
+        ztask.fit(fitZ_);
         }
 
+    TaskPool pool(numThreads());
+    pool.add(legtask);
+    pool.add(xytask);
+    pool.add(ztask);
+    pool.run();
+
+    fit_ = legtask.fit();
+    fitXY_ = xytask.fit();
+    fitZ_ = ztask.fit();
+
+    Real totZ1 = 0, totZ2 = 0;
+    for(int n = 1; n <= fitZ_.ReChi().Length(); ++n)
         {
-        for(int j = 1; j <= nx; ++j) 
-            {
-            fitted_V2(j) = fitZ(j);
-            exact_V2(j) = lz(j);
-            }
-        writedata("Z_fitted_V2",fitted_V2,1,params.do_plot_self);
-        writedata("Z_exact_V2",exact_V2,1,params.do_plot_self);
-        Vector V2_diff = exact_V2-fitted_V2;
-        writedata("Z_V2_diff",V2_diff,1,params.do_plot_self);
+        totZ1 += fitZ_.ReChi()(n);
+        totZ2 += fitZ_.ReChi()(n)*fitZ_.ReLambda()(n);
         }
+    //cout << format("LambdaZ = %.10f, totZ1 = %.10f, totZ2 = %.10f\n") % LambdaZ % totZ1 % totZ2 << endl;
+
+    cout << legtask.report() << xytask.report() << ztask.report();
+    }
+
+//The builder refers to the fits, which are
+//members so they outlive it
+void LongRangeH::
+makeBuilder(const Model& model, bool parity)
+    {
+    cout << format("MPO bond dimension k = %d\n") % LongRangeSpinLadder::bondDimension(fit_,fitXY_,fitZ_) << endl;
 
     Option pin;
     if(params.pinning != 0)
         pin = Pinning(params.pinning);
 
+    Option compress;
+    if(params.compress_mpo)
+        compress = CompressMPO(params.compress_tol);
+
+    Option flip;
+    if(parity)
+        flip = SpinFlipParity();
+
     if(params.smooth)
         {
         cout << "\nUsing smooth long range model.\n" << endl;
-        H = LongRangeSpinLadder(model,smoothing,fit,fitXY,fitZ,pin,
-                        StaggerPinning(params.stagger_pinning));
+        TanhSmoothing smoothing(params.nx,params.xi);
+        builder_.reset(new LongRangeSpinLadder(model,smoothing,fit_,fitXY_,fitZ_,pin,
+                        StaggerPinning(params.stagger_pinning),compress,flip));
         }
     else
         {
         cout << "\nUsing long range model.\n" << endl;
-        H = LongRangeSpinLadder(model,fit,fitXY,fitZ,pin,
-                    StaggerPinning(params.stagger_pinning));
+        builder_.reset(new LongRangeSpinLadder(model,fit_,fitXY_,fitZ_,pin,
+                    StaggerPinning(params.stagger_pinning),compress,flip));
         }
+    }
 
+//
+// Built Hamiltonians are cached in the directory
+// params.mpo_cache under a hash of every parameter they
+// depend on; the full key is stored with each one and
+// checked on reading. A cached SparseMPO is mapped
+// read-only in place, so concurrent jobs on a node share
+// one copy, and takes its operators from the live model.
+// IQMPO and MPO caches are read into memory with the site
+// indices of the model they were built for, so they are
+// only used if that is the model of this run (read from
+// model_<nx>, or model_parity_<nx> for the parity mode).
+//
+string
+hamiltonianKey(bool parity)
+    {
+    return (format("%s LambdaXY=%.12g") % modelKey(parity) % params.LambdaXY).str();
     }
 
-void
-printLocalMeasurements(IQMPS& psi)
+string
+cacheName(const string& key, const string& kind)
     {
-    const Model& model = psi.model();
-    const int N = model.NN();
+    //64 bit FNV-1a
+    unsigned long h = 14695981039346656037UL;
+    for(size_t n = 0; n < key.size(); ++n)
+        {
+        h ^= (unsigned char) key[n];
+        h *= 1099511628211UL;
+        }
+    return (format("%s/H_%016lx.%s") % params.mpo_cache % h % kind).str();
+    }
 
-    //Measure sz on every site
-    for(int j = 1; j <= N; ++j)
+string
+cacheKind(const IQMPO&) { return "iqmpo"; }
+
+string
+cacheKind(const MPO&) { return "mpo"; }
+
+bool
+readCachedH(const Model& model, const string& key, SparseMPO& H)
+    {
+    return SparseMPO::map(cacheName(key,"sparse"),key,model,H);
+    }
+
+template<class Tensor>
+bool
+readCachedH(const Model& model, const string& key, MPOt<Tensor>& H)
+    {
+    const string fname = cacheName(key,cacheKind(H));
+    ifstream kf((fname + ".key").c_str());
+    string stored;
+    getline(kf,stored);
+    if(!kf || stored != key || !fexist(fname)) return false;
+    H = MPOt<Tensor>(model);
+    readFromFile(fname,H);
+    for(int j = 1; j <= model.NN(); ++j)
         {
-        psi.position(j);
-        IQTensor zket = model.sz(j)*psi.AA(j);
-        zket.noprime();
-        Real sz = Dot(conj(psi.AA(j)),zket);
-        cout << format("Sz %d %.10f") % j % sz << endl;
+        if(!H.AA(j).hasindex(model.si(j)))
+            {
+            cout << "Cached Hamiltonian " << fname << " was built for another model, rebuilding" << endl;
+            return false;
+            }
         }
+    return true;
     }
 
 void
-printLocalMeasurements(MPS& psi)
+writeCachedH(const string& key, const SparseMPO& H)
     {
-    const Model& model = psi.model();
-    const int N = model.NN();
+    H.write(cacheName(key,"sparse"),key);
+    }
 
-    vector<Real> sx(N+2,-100),sz(N+2,-100);
+template<class Tensor>
+void
+writeCachedH(const string& key, const MPOt<Tensor>& H)
+    {
+    const string fname = cacheName(key,cacheKind(H));
+    writeCache(fname,H);
+    const string tmpname = (format("%s.key.%d.%p") % fname % getpid() % &H).str();
+    ofstream kf(tmpname.c_str());
+    kf << key << endl;
+    kf.close();
+    rename(tmpname.c_str(),(fname + ".key").c_str());
+    }
 
-    //Measure sx & sz on every site
-    for(int j = 1; j <= N; ++j)
+template<class MPOType>
+void
+makeCachedH(LongRangeH& maker, const Model& model, MPOType& H, bool parity = false)
+    {
+    if(params.mpo_cache == "")
         {
-        psi.position(j);
-        ITensor xket = model.sx(j)*psi.AA(j);
-        xket.noprime();
-        ITensor zket = model.sz(j)*psi.AA(j);
-        zket.noprime();
-        ITensor bra = conj(psi.AA(j));
-        sx[j] = Dot(bra,xket);
-        sz[j] = Dot(bra,zket);
+        maker.make(model,H,parity);
+        return;
         }
 
-    //Print values
-    for(int j = 1; j <= N; ++j)
+    const string key = hamiltonianKey(parity);
+    if(readCachedH(model,key,H))
         {
-        cout << format("Sx %d %.10f") % j % sx[j] << endl;
+        cout << "Using cached Hamiltonian for " << key << endl;
+        return;
         }
-    cout << endl << endl;
-    for(int j = 1; j <= N; ++j)
+    maker.make(model,H,parity);
+    writeCachedH(key,H);
+    }
+
+//
+// DMRG runs can be steered by signals and the control
+// file dmrg_control.<pid> (see TopOpts::control), write
+// checkpoints as often as params.checkpoint_bonds and
+// checkpoint_minutes say, with adaptive_sweeps choose
+// their sweeps as they go (up to maxm states), with
+// davidson_policy spend only the Davidson iterations the
+// truncation error warrants, with do_timing log
+// timings and bond dimensions per bond and sweep to
+// params.timing_file and with write_entropy write the
+// entanglement profile of the final sweep to
+// entropy_<state>. Runs with a SparseMPO (sparse) get
+// no noise, which LocalSparseMPO can't add.
+//
+template<class Tensor>
+void
+setupOpts(TopOpts<Tensor>& opts, Sweeps& sweeps, const string& state, bool sparse = false)
+    {
+    //LocalSparseMPO has no noise term (see deltaRho)
+    if(sparse)
+        {
+        bool noisy = false;
+        for(int s = 1; s <= sweeps.nsweep(); ++s)
+            {
+            if(sweeps.noise(s) != 0) noisy = true;
+            sweeps.setNoise(s,0);
+            }
+        if(noisy)
+            cout << "Noise is not supported with sparse_mpo, turning it off." << endl;
+        }
+
+    opts.control(sweeps,(format("dmrg_control.%d") % getpid()).str());
+    opts.checkpointEvery(params.checkpoint_bonds,params.checkpoint_minutes);
+    if(params.adaptive_sweeps)
+        opts.adaptive(AdaptiveSweeps(params.energy_tol,params.trunc_tol,params.esaccuracy,params.maxm));
+    if(params.davidson_policy)
+        opts.davidsonPolicy(DavidsonPolicy(params.davidson_rate));
+    if(params.write_entropy)
+        opts.entropyFile("entropy_" + state);
+
+    if(sparse)
+        opts.productCounter(LocalSparseMPO::nproduct());
+    if(params.do_timing)
+        opts.telemetry(params.timing_file);
+    }
+
+//Makes sweeps s0, s0+1, ... of sweeps its sweeps 1, 2, ...
+void
+shiftSweeps(Sweeps& sweeps, int s0)
+    {
+    for(int s = 1; s+s0-1 <= sweeps.nsweep(); ++s)
         {
-        cout << format("Sz %d %.10f") % j % sz[j] << endl;
+        sweeps.setMaxm(s,sweeps.maxm(s+s0-1));
+        sweeps.setMinm(s,sweeps.minm(s+s0-1));
+        sweeps.setCutoff(s,sweeps.cutoff(s+s0-1));
+        sweeps.setNiter(s,sweeps.niter(s+s0-1));
+        sweeps.setNoise(s,sweeps.noise(s+s0-1));
         }
     }
 
+//
+// Measures params.measure_site on every site and the
+// correlators params.measure_pairs of all pairs of sites
+// in one pass (see Measurements), prints the one-site
+// values and writes everything to meas_<state>
+//
+template<class Tensor>
+void
+printLocalMeasurements(MPSt<Tensor>& psi, const string& state,
+                       const string& site_ops = params.measure_site,
+                       const string& pairs = params.measure_pairs)
+    {
+    Measurements<Tensor> meas(site_ops,pairs);
+    meas.measure(psi);
+    meas.print();
+    meas.write("meas_" + state);
+    }
+
 template<class Tensor>
 void
 printOffDiagMeasurements(MPSt<Tensor>& psiA,MPSt<Tensor>& psiB, 
@@ -367,6 +824,9 @@ int main(int argc, char* argv[])
     else
         {
         model = SpinHalf(N);
+        //Checkpoints and cached MPOs are only valid with
+        //the same model, so save it before either is made
+        writeToFile(model_name,model);
         }
 
     TanhSmoothing smoothing(nx,params.xi);
@@ -383,6 +843,11 @@ int main(int argc, char* argv[])
     InputGroup table(basic,"sweeps");
     Sweeps sweeps(params.nsweeps,table);
     cout << sweeps;
+    cout << format("\nProcess %d: SIGUSR1 stops after the current sweep, SIGUSR2 writes a checkpoint,\n"
+                   "SIGHUP reads commands from dmrg_control.%d\n") % getpid() % getpid() << endl;
+
+    //Keeps fits between the Hamiltonians of a parameter sweep
+    LongRangeH longrange;
 
     if(params.runmode == "solve")
     {
@@ -409,42 +874,11 @@ int main(int argc, char* argv[])
         }
 
     Real En = 0;
-    /*
-    if(params.interaction_cutoff > -1)
-        {
-        cout << "params.interaction_cutoff = " << params.interaction_cutoff << endl;
-        vector<IQMPO> terms;
-        if(1)
-            {
-            HTerms(model,LambdaXY,LambdaZ,terms,Cutoff(params.interaction_cutoff));
-            cout << format("Summing %d terms to form H") % terms.size() << endl;
-            IQMPO Hs;
-            sum(terms,Hs);
-            cout << "Starting DMRG" << endl;
-            En = dmrg(psi,Hs,sweeps,opts,Quiet(params.quiet_dmrg));
-            cout << format("GS Energy = %.10f\n") % En;
-
-            Real checkEn = 0;
-            Foreach(const IQMPO& term, terms)
-                {
-                checkEn += psiHphi(psi,term,psi);
-                }
-            cout << format("Check Energy = %.10f\n") % checkEn;
-
-            cout << format("Energy using full H = %.10f\n") % psiHphi(psi,H,psi);
-            }
-        else
-            {
-            HTerms(model,LambdaXY,LambdaZ,terms,Cutoff(params.interaction_cutoff),Offset());
-            cout << format("Starting DMRG using %d H terms") % (terms.size()-1) << endl;
-            En = dmrg(psi,terms,sweeps,opts,Quiet(params.quiet_dmrg));
-            }
-        }
-        */
 
 
 
     IQMPO H;
+    SparseMPO Hs;
 
     Real *swp_paramP = 0;
     if(params.sweep_param == "lambdaxy")
@@ -461,31 +895,79 @@ int main(int argc, char* argv[])
 
     for(swp_param = params.param_start; (swp_param-params.param_end) < 1E-8; swp_param += params.param_step)
         {
+        const string gsname = (format("gs_psi_%s_%.4f")%params.sweep_param%swp_param).str();
+        const string ckname = "checkpoint_" + gsname;
+
+        //With resume, skip points already done and pick up
+        //an interrupted one at the sweep of its checkpoint
+        Sweeps psweeps(sweeps);
+        int first_sweep = 1;
+        if(params.resume)
+            {
+            int ck_sw = 0, ck_ha = 0, ck_b = 0;
+            if(fexist(gsname))
+                {
+                cout << "Reading finished wavefunction " << gsname << ", skipping this point." << endl;
+                readFromFile(gsname,psi);
+                continue;
+                }
+            else
+            if(fexist(ckname) && CheckpointWriter<IQTensor>::readInfo(ckname,ck_sw,ck_ha,ck_b))
+                {
+                cout << format("Resuming from %s, written in sweep %d (half %d, bond %d)") 
+                        % ckname % ck_sw % ck_ha % ck_b << endl;
+                readFromFile(ckname,psi);
+                first_sweep = ck_sw;
+                shiftSweeps(psweeps,first_sweep);
+                }
+            }
+
         cout << format("\n\nMaking Hamiltonian with sweep param %s = %.10f\n") % params.sweep_param % swp_param << endl;
         if(params.nn)
             {
             cout << "\nUsing nearest-neighbor model.\n" << endl;
-            H = NNSpinLadder(model,params.LambdaXY,params.LambdaZ);
+            if(params.sparse_mpo)
+                Hs = NNSpinLadder(model,params.LambdaXY,params.LambdaZ);
+            else
+                H = NNSpinLadder(model,params.LambdaXY,params.LambdaZ);
             }
         else
             {
-            makeLongRangeH(model,H);
+            if(params.sparse_mpo)
+                makeCachedH(longrange,model,Hs);
+            else
+                makeCachedH(longrange,model,H);
             }
 
+        //Control file changes to the schedule carry over to later
+        //points; adaptive sweeps rewrite the table, so they get a copy
+        Sweeps& rsweeps = (first_sweep > 1 || params.adaptive_sweeps ? psweeps : sweeps);
+
         TopOpts<IQTensor> opts(psi,model);
+        setupOpts(opts,rsweeps,(format("%s_%.4f")%params.sweep_param%swp_param).str(),params.sparse_mpo);
+        opts.checkpointFile(ckname);
+        if(first_sweep > 1)
+            opts.lastSweep(sweeps.nsweep()-first_sweep+1);
         if(params.esaccuracy > 0)
             opts.esAccuracy(params.esaccuracy);
         //opts.notifyTimes(4);
 
-        En = dmrg(psi,H,sweeps,opts,Quiet(params.quiet_dmrg));
+        if(params.sparse_mpo)
+            En = dmrg(psi,Hs,rsweeps,opts,Quiet(params.quiet_dmrg));
+        else
+            En = dmrg(psi,H,rsweeps,opts,Quiet(params.quiet_dmrg));
         cout << format("GS Energy = %.10f\n") % En;
 
         cout << "Printing local measurements" << endl;
-        printLocalMeasurements(psi);
+        printLocalMeasurements(psi,(format("%s_%.4f")%params.sweep_param%swp_param).str());
 
-        writeToFile(format("gs_psi_%s_%.4f")%params.sweep_param%swp_param,psi);
+        writeCache(gsname,psi);
         writeToFile(model_name,model);
 
+        opts.waitCheckpoint();
+        std::remove(ckname.c_str());
+        std::remove((ckname + ".info").c_str());
+
         }
 
 
@@ -520,7 +1002,7 @@ int main(int argc, char* argv[])
         }
     else
         {
-        makeLongRangeH(model,H);
+        makeCachedH(longrange,model,H);
         }
 
     vector<IQMPS> psi;
@@ -551,17 +1033,22 @@ int main(int argc, char* argv[])
         {
         IQMPS newpsi(model,initState);
 
+        //Adaptive sweeps rewrite their table, so each run gets a copy
+        Sweeps asweeps(sweeps);
+        Sweeps& rsweeps = (params.adaptive_sweeps ? asweeps : sweeps);
+
         TopOpts<IQTensor> opts(newpsi,model);
+        setupOpts(opts,rsweeps,(format("gap_state%d")%state).str());
 
         cout << format("\n\nBeginning DMRG calculation for state %d\n") % state << endl;
 
         if(state == 0)
             {
-            energy.at(state) = dmrg(newpsi,H,sweeps,opts,Quiet(params.quiet_dmrg));
+            energy.at(state) = dmrg(newpsi,H,rsweeps,opts,Quiet(params.quiet_dmrg));
             }
         else
             {
-            energy.at(state) = dmrg(newpsi,H,psi,sweeps,opts,
+            energy.at(state) = dmrg(newpsi,H,psi,rsweeps,opts,
                                     Weight(params.orth_weight),Quiet(params.quiet_dmrg));
             }
 
@@ -648,7 +1135,7 @@ int main(int argc, char* argv[])
     for(int state = 0; state < nstates; ++state)
         {
         cout << format("Printing local measurements for state %d") % state << endl;
-        printLocalMeasurements(psi.at(state));
+        printLocalMeasurements(psi.at(state),(format("gap_state%d")%state).str());
         cout << "\n\n" << endl;
         }
 
@@ -665,6 +1152,98 @@ int main(int argc, char* argv[])
 
     } //end runmode gap
     else
+    if(params.runmode == "parity")
+    {
+    //Pinning breaks Sz conservation but not the spin flip
+    //parity prod_j 2Sx_j, which keeps the tensors block sparse
+    if(params.nn)
+        Error("NN model not supported with spin flip parity");
+
+    const string pmodel_name = (format("model_parity_%d") % nx).str();
+    SpinHalfParity pmodel(N);
+    if(fexist(pmodel_name))
+        {
+        cout << "Reading model " << pmodel_name << " from disk." << endl;
+        readFromFile(pmodel_name,pmodel);
+        }
+    else
+        {
+        writeToFile(pmodel_name,pmodel);
+        }
+
+    IQMPS psi(pmodel);
+    if(params.wfname != "" && fexist(params.wfname))
+        {
+        cout << "Reading wavefunction " << params.wfname << " from file." << endl;
+        readFromFile(params.wfname,psi);
+        }
+    else
+        {
+        //All spins along +x (even parity), or the odd
+        //sector with one spin flipped
+        InitState initState(N);
+        for(int i = 1; i <= N; ++i) 
+            initState(i) = pmodel.Right(i);
+        if(params.triplet_sector)
+            {
+            cout << "\n\nInitializing wavefunction to odd parity sector\n" << endl;
+            initState(1) = pmodel.Left(1);
+            }
+        cout << "Creating new initial state wavefunction." << endl;
+        psi = IQMPS(pmodel,initState);
+        }
+
+    Real En = 0;
+
+    IQMPO H;
+    SparseMPO Hs;
+
+    Real *swp_paramP = 0;
+    if(params.sweep_param == "lambdaxy")
+        swp_paramP = &(params.LambdaXY);
+
+    Real &swp_param = *swp_paramP;
+
+    if(!params.do_param_sweep)
+        {
+        params.param_start = swp_param;
+        params.param_end = swp_param;
+        params.param_step = 1000;
+        }
+
+    for(swp_param = params.param_start; (swp_param-params.param_end) < 1E-8; swp_param += params.param_step)
+        {
+        cout << format("\n\nMaking Hamiltonian with sweep param %s = %.10f\n") % params.sweep_param % swp_param << endl;
+        if(params.sparse_mpo)
+            makeCachedH(longrange,pmodel,Hs,true);
+        else
+            makeCachedH(longrange,pmodel,H,true);
+
+        //Adaptive sweeps rewrite their table, so each run gets a copy
+        Sweeps asweeps(sweeps);
+        Sweeps& rsweeps = (params.adaptive_sweeps ? asweeps : sweeps);
+
+        TopOpts<IQTensor> opts(psi,pmodel);
+        setupOpts(opts,rsweeps,(format("parity_%s_%.4f")%params.sweep_param%swp_param).str(),params.sparse_mpo);
+        if(params.esaccuracy > 0)
+            opts.esAccuracy(params.esaccuracy);
+
+        if(params.sparse_mpo)
+            En = dmrg(psi,Hs,rsweeps,opts,Quiet(params.quiet_dmrg));
+        else
+            En = dmrg(psi,H,rsweeps,opts,Quiet(params.quiet_dmrg));
+        cout << format("GS Energy = %.10f\n") % En;
+
+        cout << "Printing local measurements" << endl;
+        //Sz vanishes in a parity eigenstate and S+, S- have no
+        //definite parity, so measure Sx and the SxSx, SzSz correlators
+        printLocalMeasurements(psi,(format("parity_%s_%.4f")%params.sweep_param%swp_param).str(),"Sx","Sx:Sx,Sz:Sz");
+
+        writeToFile(format("gs_psi_parity_%s_%.4f")%params.sweep_param%swp_param,psi);
+        }
+
+    } //end runmode parity
+    else
     if(params.runmode == "noqn")
     {
     if(params.triplet_sector)
@@ -712,19 +1291,24 @@ int main(int argc, char* argv[])
             }
         else
             {
-            makeLongRangeH(model,H);
+            makeCachedH(longrange,model,H);
             }
 
+        //Adaptive sweeps rewrite their table, so each run gets a copy
+        Sweeps asweeps(sweeps);
+        Sweeps& rsweeps = (params.adaptive_sweeps ? asweeps : sweeps);
+
         TopOpts<ITensor> opts(psi,model);
+        setupOpts(opts,rsweeps,(format("%s_%.4f")%params.sweep_param%swp_param).str());
         if(params.esaccuracy > 0)
             opts.esAccuracy(params.esaccuracy);
         //opts.notifyTimes(4);
 
-        En = dmrg(psi,H,sweeps,opts,Quiet(params.quiet_dmrg));
+        En = dmrg(psi,H,rsweeps,opts,Quiet(params.quiet_dmrg));
         cout << format("GS Energy = %.10f\n") % En;
 
         cout << "Printing local measurements" << endl;
-        printLocalMeasurements(psi);
+        printLocalMeasurements(psi,(format("%s_%.4f")%params.sweep_param%swp_param).str(),"Sx," + params.measure_site);
 
         writeToFile(format("gs_psi_%s_%.4f")%params.sweep_param%swp_param,psi);
         writeToFile(model_name,model);
@@ -750,7 +1334,7 @@ int main(int argc, char* argv[])
         }
     else
         {
-        makeLongRangeH(model,H);
+        makeCachedH(longrange,model,H);
         }
 
     cout << "\n\nNot using quantum numbers\n" << endl;
@@ -776,17 +1360,22 @@ int main(int argc, char* argv[])
         {
         MPS newpsi(model,initState);
 
+        //Adaptive sweeps rewrite their table, so each run gets a copy
+        Sweeps asweeps(sweeps);
+        Sweeps& rsweeps = (params.adaptive_sweeps ? asweeps : sweeps);
+
         TopOpts<ITensor> opts(newpsi,model);
+        setupOpts(opts,rsweeps,(format("gap_state%d")%state).str());
 
         cout << format("\n\nBeginning DMRG calculation for state %d\n") % state << endl;
 
         if(state == 0)
             {
-            energy.at(state) = dmrg(newpsi,H,sweeps,opts,Quiet(params.quiet_dmrg));
+            energy.at(state) = dmrg(newpsi,H,rsweeps,opts,Quiet(params.quiet_dmrg));
             }
         else
             {
-            energy.at(state) = dmrg(newpsi,H,psi,sweeps,opts,
+            energy.at(state) = dmrg(newpsi,H,psi,rsweeps,opts,
                                     Weight(params.orth_weight),Quiet(params.quiet_dmrg));
             }
 
@@ -873,7 +1462,7 @@ int main(int argc, char* argv[])
     for(int state = 0; state < nstates; ++state)
         {
         cout << format("Printing local measurements for state %d") % state << endl;
-        printLocalMeasurements(psi.at(state));
+        printLocalMeasurements(psi.at(state),(format("gap_state%d")%state).str(),"Sx," + params.measure_site);
         cout << "\n\n" << endl;
         }
 
@@ -1,11 +1,266 @@
 #ifndef __TOPOPTS_H
 #define __TOPOPTS_H
 #include "DMRGObserver.h"
+#include "Sweeps.h"
+#include "adaptivesweeps.h"
+#include "davidsonpolicy.h"
+#include <cerrno>
+#include <cstdio>
+#include <csignal>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <boost/shared_ptr.hpp>
+#include <pthread.h>
+#include <sys/time.h>
+#include <unistd.h>
 
 #define Format boost::format
 #define Cout std::cout
 #define Endl std::endl
 
+//
+// Signals steering running DMRG jobs (see TopOpts::control):
+//
+//   SIGUSR1  stop after the current sweep
+//   SIGUSR2  write the wavefunction at the next bond
+//   SIGHUP   read commands from the job's control file
+//
+// The handlers only set these flags, which observers
+// look at between bonds; nothing polls the filesystem.
+//
+struct DMRGSignals
+    {
+    volatile sig_atomic_t stop,
+                          checkpoint,
+                          reload;
+
+    static DMRGSignals&
+    get()
+        {
+        static DMRGSignals s = { 0, 0, 0 };
+        return s;
+        }
+
+    static void
+    handler(int sig)
+        {
+        if(sig == SIGUSR1) get().stop = 1;
+        else if(sig == SIGUSR2) get().checkpoint = 1;
+        else if(sig == SIGHUP) get().reload = 1;
+        }
+
+    static void
+    install()
+        {
+        struct sigaction sa;
+        sa.sa_handler = handler;
+        sigemptyset(&sa.sa_mask);
+        sa.sa_flags = SA_RESTART;
+        sigaction(SIGUSR1,&sa,0);
+        sigaction(SIGUSR2,&sa,0);
+        sigaction(SIGHUP,&sa,0);
+        }
+    };
+
+//
+// Writes a copy of an MPS to fname on a thread of its
+// own, so that a sweep never waits for the disk; the copy
+// shares the tensor storage, which DMRG replaces rather
+// than overwrites, and is only made and released on the
+// sweep's thread. The position (sweep, half sweep, bond)
+// goes to fname.info: both are written under temporary
+// names, the old fname.info is removed, and the MPS and
+// then the .info are renamed into place, so a crash never
+// pairs an MPS with the position of another. One write
+// runs at a time: start returns false while one is going.
+// A failed write is reported, on the sweep's thread, by
+// the next start or wait.
+//
+template<class Tensor>
+class CheckpointWriter
+    {
+    public:
+
+    CheckpointWriter()
+        :
+        running_(false),
+        done_(false)
+        { pthread_mutex_init(&mutex_,0); }
+
+    ~CheckpointWriter()
+        {
+        wait();
+        pthread_mutex_destroy(&mutex_);
+        }
+
+    bool
+    start(const MPSt<Tensor>& psi, const std::string& fname, int sw, int ha, int b);
+
+    void
+    wait();
+
+    //Reads the position written with a checkpoint,
+    //false if there is none
+    static bool
+    readInfo(const std::string& fname, int& sw, int& ha, int& b);
+
+    private:
+
+    MPSt<Tensor> psi_;
+    std::string fname_;
+    int sw_, 
+        ha_, 
+        b_;
+    bool running_;
+    pthread_t thread_;
+
+    //Set by the writing thread when it is finished
+    bool done_;
+    pthread_mutex_t mutex_;
+
+    //Why the last write failed, empty if it did not
+    std::string error_;
+
+    void
+    write();
+
+    bool
+    done();
+
+    static void*
+    run(void* arg);
+
+    //Not copyable
+    CheckpointWriter(const CheckpointWriter&);
+    void operator=(const CheckpointWriter&);
+
+    };
+
+template<class Tensor>
+bool inline CheckpointWriter<Tensor>::
+start(const MPSt<Tensor>& psi, const std::string& fname, int sw, int ha, int b)
+    {
+    if(running_)
+        {
+        if(!done()) return false;
+        wait();
+        }
+    psi_ = psi;
+    fname_ = fname;
+    sw_ = sw;
+    ha_ = ha;
+    b_ = b;
+    done_ = false;
+    if(pthread_create(&thread_,0,run,this) != 0)
+        {
+        Error("Could not start checkpoint thread");
+        return false;
+        }
+    running_ = true;
+    return true;
+    }
+
+template<class Tensor>
+void inline CheckpointWriter<Tensor>::
+wait()
+    {
+    if(!running_) return;
+    pthread_join(thread_,0);
+    running_ = false;
+    psi_ = MPSt<Tensor>();
+    if(!error_.empty())
+        {
+        Cout << Format("Checkpoint %s failed: %s") % fname_ % error_ << Endl;
+        error_.clear();
+        }
+    }
+
+template<class Tensor>
+void* CheckpointWriter<Tensor>::
+run(void* arg)
+    {
+    CheckpointWriter& w = *static_cast<CheckpointWriter*>(arg);
+    //Nothing may be thrown out of a thread
+    try
+        {
+        w.write();
+        }
+    catch(const std::exception& e)
+        {
+        w.error_ = e.what();
+        }
+    catch(...)
+        {
+        w.error_ = "unknown error";
+        }
+
+    pthread_mutex_lock(&w.mutex_);
+    w.done_ = true;
+    pthread_mutex_unlock(&w.mutex_);
+    return 0;
+    }
+
+template<class Tensor>
+void inline CheckpointWriter<Tensor>::
+write()
+    {
+    const std::string tmpname = (Format("%s.%d") % fname_ % getpid()).str(),
+                      tmpinfo = tmpname + ".info",
+                      info = fname_ + ".info";
+
+    writeToFile(tmpname,psi_);
+
+    std::ofstream f(tmpinfo.c_str());
+    f << sw_ << " " << ha_ << " " << b_ << std::endl;
+    f.close();
+    if(f.fail())
+        {
+        error_ = "could not write " + tmpinfo;
+        std::remove(tmpname.c_str());
+        return;
+        }
+
+    if(std::remove(info.c_str()) != 0 && errno != ENOENT)
+        {
+        error_ = "could not remove " + info + ": " + std::strerror(errno);
+        std::remove(tmpname.c_str());
+        std::remove(tmpinfo.c_str());
+        return;
+        }
+    if(std::rename(tmpname.c_str(),fname_.c_str()) != 0)
+        {
+        error_ = "could not rename " + tmpname + ": " + std::strerror(errno);
+        std::remove(tmpname.c_str());
+        std::remove(tmpinfo.c_str());
+        return;
+        }
+    if(std::rename(tmpinfo.c_str(),info.c_str()) != 0)
+        {
+        error_ = "could not rename " + tmpinfo + ": " + std::strerror(errno);
+        std::remove(tmpinfo.c_str());
+        }
+    }
+
+template<class Tensor>
+bool inline CheckpointWriter<Tensor>::
+done()
+    {
+    pthread_mutex_lock(&mutex_);
+    const bool res = done_;
+    pthread_mutex_unlock(&mutex_);
+    return res;
+    }
+
+template<class Tensor>
+bool inline CheckpointWriter<Tensor>::
+readInfo(const std::string& fname, int& sw, int& ha, int& b)
+    {
+    std::ifstream info((fname + ".info").c_str());
+    info >> sw >> ha >> b;
+    return !info.fail();
+    }
+
 template<class Tensor>
 class TopOpts : public DMRGObserver
     {
@@ -15,7 +270,7 @@ class TopOpts : public DMRGObserver
     Parent;
 
     TopOpts(const MPSt<Tensor>& psi, 
-            const SpinHalf& model, const std::string& pfix = "");
+            const Model& model, const std::string& pfix = "");
 
     const std::string& 
     prefix() const { return prefix_; }
@@ -32,6 +287,86 @@ class TopOpts : public DMRGObserver
     void 
     esAccuracy(Real val) { es_accuracy_ = val; }
 
+    //
+    // Appends one JSON object per line to the file fname:
+    // for every bond optimized its wall time (Davidson and
+    // SVD), kept m, truncation error, energy and resident
+    // memory, then totals for each sweep. Off by default;
+    // when off, measure does no extra work.
+    //
+    void
+    telemetry(const std::string& fname);
+
+    //
+    // Lets signals steer this run (see DMRGSignals). The
+    // control file, read on SIGHUP and then removed, has
+    // one command per line:
+    //
+    //   stop             stop after the current sweep
+    //   checkpoint       write the wavefunction now
+    //   maxm <m>         set maxm, minm or cutoff for all
+    //   minm <m>         sweeps after the current one
+    //   cutoff <x>
+    //
+    void
+    control(Sweeps& sweeps, const std::string& ctlfile);
+
+    //
+    // Writes the wavefunction every nbonds bonds or every
+    // minutes minutes (0 for never), by a CheckpointWriter.
+    // Checkpoints go to checkpointFile(), which defaults to
+    // checkpoint_psi_<prefix or pid>.
+    //
+    void
+    checkpointEvery(int nbonds, Real minutes);
+
+    const std::string&
+    checkpointFile() const { return ckfile_; }
+    void
+    checkpointFile(const std::string& val) { ckfile_ = val; }
+
+    //Let a (a copy of it) set the sweeps after each one;
+    //needs control() for the Sweeps to set
+    void
+    adaptive(const AdaptiveSweeps& a) { adapt_.reset(new AdaptiveSweeps(a)); }
+
+    //
+    // Sets the Davidson iterations of each bond from the
+    // truncation error at the one before and the energy
+    // change of the last sweep (see DavidsonPolicy), within
+    // the sweep's own niter; needs control(). How far the
+    // iteration budget was cut is reported per sweep (and
+    // per bond with telemetry); Davidson may stop below
+    // either budget, so that is not a measured saving. With
+    // a productCounter the H*phi products actually made are
+    // reported too.
+    //
+    void
+    davidsonPolicy(const DavidsonPolicy& p) { policy_.reset(new DavidsonPolicy(p)); }
+
+    //
+    // Records the von Neumann and Renyi-2 entropies, the
+    // entanglement splitting and the kept m at every bond
+    // from the density matrix eigenvalues each bond already
+    // has, and after every sweep writes those of the last
+    // one to fname, one line per bond.
+    //
+    void
+    entropyFile(const std::string& fname);
+
+    //Stop after sweep n, e.g. when resuming a run
+    void
+    lastSweep(int n) { last_sweep_ = n; }
+
+    //Returns once a checkpoint being written is complete
+    void
+    waitCheckpoint() { writer_->wait(); }
+
+    //A count of H*phi products to report per bond as the
+    //Davidson iterations, e.g. LocalSparseMPO::nproduct()
+    void
+    productCounter(const long& count) { nprod_ = &count; last_nprod_ = count; }
+
     virtual void 
     measure(int sw, int ha, int b, const SVDWorker& svd, Real energy,
             const Option& opt1 = Option(), const Option& opt2 = Option(),
@@ -49,7 +384,7 @@ class TopOpts : public DMRGObserver
     //
 
     const MPSt<Tensor>& psi_;
-    const SpinHalf& model_;
+    const Model& model_;
 
     bool do_plot_self;
     int notify_times_;
@@ -60,6 +395,67 @@ class TopOpts : public DMRGObserver
          curr_es_,
          es_accuracy_;
 
+    //Telemetry, if tel_ is set, and sweep
+    //statistics for it and for adapt_
+    boost::shared_ptr<std::ofstream> tel_;
+    boost::shared_ptr<AdaptiveSweeps> adapt_;
+    boost::shared_ptr<DavidsonPolicy> policy_;
+    const long* nprod_;
+    Real last_time_,
+         sweep_time_,
+         sweep_truncerr_;
+    long last_nprod_,
+         sweep_nprod_;
+    int sweep_m_;
+
+    //Davidson policy: the sweep's own niter, the last
+    //sweep's energy change and how far the budget was cut
+    int policy_sw_,
+        table_niter_,
+        sweep_cut_;
+    Real last_energy_,
+         last_dE_;
+    long total_cut_;
+
+    //Control by signals, if sweeps_ is set
+    Sweeps* sweeps_;
+    std::string ctlfile_;
+
+    //Entanglement profile, if esfile_ is set
+    std::string esfile_;
+    std::vector<Real> svn_,
+                      s2_,
+                      split_;
+    std::vector<int> mkept_;
+
+    //Checkpoints
+    boost::shared_ptr<CheckpointWriter<Tensor> > writer_;
+    std::string ckfile_;
+    int ck_bonds_,
+        bonds_since_ck_,
+        last_sweep_;
+    Real ck_seconds_,
+         last_ck_time_;
+
+    void
+    readControl(int sw);
+
+    bool
+    checkpoint(int sw, int ha, int b);
+
+    void
+    writeEntropies() const;
+
+    static Real
+    splitting(const Vector& eigs);
+
+    static Real
+    wallTime();
+
+    //Resident set size in MB, -1 if unknown
+    static Real
+    residentMB();
+
     //
     /////////////
 
@@ -68,7 +464,7 @@ class TopOpts : public DMRGObserver
 template <class Tensor>
 inline TopOpts<Tensor>::
 TopOpts(const MPSt<Tensor>& psi,
-        const SpinHalf& model, const std::string& pfix)
+        const Model& model, const std::string& pfix)
     : 
     psi_(psi), 
     model_(model), 
@@ -77,9 +473,169 @@ TopOpts(const MPSt<Tensor>& psi,
     prefix_(pfix),
     last_es_(1000),
     curr_es_(-1000),
-    es_accuracy_(-1)
+    es_accuracy_(-1),
+    nprod_(0),
+    last_time_(0),
+    sweep_time_(0),
+    sweep_truncerr_(0),
+    last_nprod_(0),
+    sweep_nprod_(0),
+    sweep_m_(0),
+    policy_sw_(-1),
+    table_niter_(0),
+    sweep_cut_(0),
+    last_energy_(0),
+    last_dE_(-1),
+    total_cut_(0),
+    sweeps_(0),
+    writer_(new CheckpointWriter<Tensor>()),
+    ckfile_("checkpoint_psi_" + (pfix == "" ? (Format("%d") % getpid()).str() : pfix)),
+    ck_bonds_(0),
+    bonds_since_ck_(0),
+    last_sweep_(-1),
+    ck_seconds_(0),
+    last_ck_time_(0)
     { }
 
+template <class Tensor>
+void inline TopOpts<Tensor>::
+control(Sweeps& sweeps, const std::string& ctlfile)
+    {
+    sweeps_ = &sweeps;
+    ctlfile_ = ctlfile;
+    DMRGSignals::install();
+    }
+
+template <class Tensor>
+void inline TopOpts<Tensor>::
+entropyFile(const std::string& fname)
+    {
+    esfile_ = fname;
+    const int N = model_.NN();
+    svn_.assign(N,0);
+    s2_.assign(N,0);
+    split_.assign(N,0);
+    mkept_.assign(N,0);
+    }
+
+template <class Tensor>
+void inline TopOpts<Tensor>::
+writeEntropies() const
+    {
+    std::ofstream f(esfile_.c_str());
+    f << "#bond m S_vN S_2 splitting" << std::endl;
+    for(int b = 1; b < int(mkept_.size()); ++b)
+        f << Format("%d %d %.12f %.12f %.12f") % b % mkept_[b] % svn_[b] % s2_[b] % split_[b] << std::endl;
+    }
+
+//Sum of the differences of the singular values of
+//successive pairs, zero for a doubly degenerate spectrum
+template <class Tensor>
+Real inline TopOpts<Tensor>::
+splitting(const Vector& eigs)
+    {
+    Real res = 0;
+    for(int j = 1; j <= eigs.Length()/2; ++j)
+        res += sqrt(fabs(eigs(2*j-1)))-sqrt(fabs(eigs(2*j)));
+    return res;
+    }
+
+template <class Tensor>
+void inline TopOpts<Tensor>::
+checkpointEvery(int nbonds, Real minutes)
+    {
+    ck_bonds_ = nbonds;
+    ck_seconds_ = 60*minutes;
+    bonds_since_ck_ = 0;
+    last_ck_time_ = wallTime();
+    }
+
+template <class Tensor>
+bool inline TopOpts<Tensor>::
+checkpoint(int sw, int ha, int b)
+    {
+    if(!writer_->start(psi_,ckfile_,sw,ha,b)) return false;
+    Cout << Format("Writing checkpoint %s (sweep %d, half %d, bond %d)") % ckfile_ % sw % ha % b << Endl;
+    bonds_since_ck_ = 0;
+    if(ck_seconds_ > 0) last_ck_time_ = wallTime();
+    return true;
+    }
+
+template <class Tensor>
+void inline TopOpts<Tensor>::
+readControl(int sw)
+    {
+    std::ifstream f(ctlfile_.c_str());
+    if(!f)
+        {
+        Cout << "No control file " << ctlfile_ << Endl;
+        return;
+        }
+
+    std::string line;
+    while(std::getline(f,line))
+        {
+        std::istringstream ls(line);
+        std::string cmd;
+        if(!(ls >> cmd)) continue;
+
+        if(cmd == "stop")
+            DMRGSignals::get().stop = 1;
+        else if(cmd == "checkpoint")
+            DMRGSignals::get().checkpoint = 1;
+        else if(cmd == "maxm" || cmd == "minm" || cmd == "cutoff")
+            {
+            Real val = 0;
+            if(!(ls >> val))
+                {
+                Cout << "Control: no value in \"" << line << "\"" << Endl;
+                continue;
+                }
+            for(int s = sw+1; s <= sweeps_->nsweep(); ++s)
+                {
+                if(cmd == "maxm") sweeps_->setMaxm(s,int(val));
+                else if(cmd == "minm") sweeps_->setMinm(s,int(val));
+                else sweeps_->setCutoff(s,val);
+                }
+            Cout << Format("Control: %s = %.3g from sweep %d on") % cmd % val % (sw+1) << Endl;
+            }
+        else
+            Cout << "Control: unknown command \"" << line << "\"" << Endl;
+        }
+    std::remove(ctlfile_.c_str());
+    }
+
+template <class Tensor>
+void inline TopOpts<Tensor>::
+telemetry(const std::string& fname)
+    {
+    tel_ = boost::shared_ptr<std::ofstream>(new std::ofstream(fname.c_str(),std::ios::app));
+    if(!*tel_)
+        Error("Could not open telemetry file " + fname);
+    last_time_ = wallTime();
+    last_nprod_ = (nprod_ ? *nprod_ : 0);
+    }
+
+template <class Tensor>
+Real inline TopOpts<Tensor>::
+wallTime()
+    {
+    timeval tv;
+    gettimeofday(&tv,0);
+    return tv.tv_sec + 1E-6*tv.tv_usec;
+    }
+
+template <class Tensor>
+Real inline TopOpts<Tensor>::
+residentMB()
+    {
+    std::ifstream statm("/proc/self/statm");
+    long size = 0, resident = -1;
+    statm >> size >> resident;
+    if(!statm || resident < 0) return -1;
+    return resident*(sysconf(_SC_PAGESIZE)/1048576.);
+    }
+
 template <class Tensor>
 void inline TopOpts<Tensor>::
 measure(int sw, int ha, int b, const SVDWorker& svd, Real energy,
@@ -88,16 +644,79 @@ measure(int sw, int ha, int b, const SVDWorker& svd, Real energy,
     {
     Parent::measure(sw,ha,b,svd,energy);
 
+    if(tel_ || adapt_ || policy_)
+        {
+        const Real now = wallTime();
+        const long nprod = (nprod_ ? *nprod_ : 0);
+        const int m = svd.eigsKept(b).Length();
+        const Real truncerr = svd.truncerr(b);
+
+        //Iterations for the next bond
+        int budget = -1;
+        if(policy_ && sweeps_)
+            {
+            if(sw != policy_sw_)
+                {
+                policy_sw_ = sw;
+                table_niter_ = sweeps_->niter(sw);
+                }
+            budget = policy_->niter(truncerr,last_dE_,table_niter_);
+            sweeps_->setNiter(sw,budget);
+            sweep_cut_ += table_niter_-budget;
+            }
+
+        if(tel_)
+            {
+            *tel_ << Format("{\"type\":\"bond\",\"sweep\":%d,\"half\":%d,\"bond\":%d,\"time\":%.6f,"
+                            "\"m\":%d,\"truncerr\":%.6E,\"niter\":%d,\"next_niter\":%d,\"energy\":%.14f,"
+                            "\"rss_mb\":%.1f}")
+                     % sw % ha % b % (now-last_time_) % m % truncerr % (nprod_ ? nprod-last_nprod_ : -1)
+                     % budget % energy % residentMB() << Endl;
+            }
+
+        sweep_time_ += now-last_time_;
+        sweep_nprod_ += nprod-last_nprod_;
+        sweep_m_ = std::max(sweep_m_,m);
+        sweep_truncerr_ = std::max(sweep_truncerr_,truncerr);
+        last_time_ = now;
+        last_nprod_ = nprod;
+        }
+
+    if(!esfile_.empty())
+        {
+        const Vector& eigs = svd.eigsKept(b);
+        Real svn = 0, p2 = 0;
+        for(int j = 1; j <= eigs.Length(); ++j)
+            {
+            const Real p = fabs(eigs(j));
+            if(p > 0) svn -= p*log(p);
+            p2 += p*p;
+            }
+        svn_.at(b) = svn;
+        s2_.at(b) = (p2 > 0 ? -log(p2) : 0);
+        split_.at(b) = splitting(eigs);
+        mkept_.at(b) = eigs.Length();
+        }
+
+    if(sweeps_ && DMRGSignals::get().checkpoint)
+        {
+        if(checkpoint(sw,ha,b)) DMRGSignals::get().checkpoint = 0;
+        }
+    else
+    if(ck_bonds_ > 0 || ck_seconds_ > 0)
+        {
+        ++bonds_since_ck_;
+        if((ck_bonds_ > 0 && bonds_since_ck_ >= ck_bonds_)
+           || (ck_seconds_ > 0 && wallTime()-last_ck_time_ >= ck_seconds_))
+            checkpoint(sw,ha,b);
+        }
+
     if(ha == 2)
     if(abs(b - model_.NN()/2) <= 1)
         {
         const std::string pstring = (prefix_ == "" ? "" : prefix_ + "_");
 
-        Vector eigs = svd.eigsKept(model_.NN()/2);
-
-        Real splitting = 0;
-        for(int j = 1; j <= eigs.Length()/2; ++j)
-            splitting += sqrt(fabs(eigs(2*j-1)))-sqrt(fabs(eigs(2*j)));
+        const Real splitting = this->splitting(svd.eigsKept(model_.NN()/2));
 
         std::cout << boost::format("\nEntanglement splitting at bond %d = %.10f") % b % splitting << std::endl;
 
@@ -116,16 +735,6 @@ measure(int sw, int ha, int b, const SVDWorker& svd, Real energy,
     if(notify_times_ > 0 && (b+1)%(model_.NN()/notify_times_) == 0)
         std::cout << "In sweep " << sw << ", reached bond " << b << std::endl;
 
-
-    /*
-    if(b == 3 && ha == 2)
-        {
-        std::string wfname_ = "gs_psi";
-        std::cout << "Writing wavefunction to disk (as " << wfname_ << ")" << std::endl;
-        writeToFile(wfname_,psi_);
-        }
-    */
-
     }
 
 template <class Tensor>
@@ -133,9 +742,48 @@ bool inline TopOpts<Tensor>::
 checkDone(int sw, const SVDWorker& svd, Real energy,
           const Option& opt1, const Option& opt2)
     {
+    if(!esfile_.empty())
+        writeEntropies();
+
+    const Real truncerr = sweep_truncerr_;
+    const int maxm_kept = sweep_m_;
+    if(tel_)
+        {
+        *tel_ << Format("{\"type\":\"sweep\",\"sweep\":%d,\"time\":%.6f,\"max_m\":%d,"
+                        "\"max_truncerr\":%.6E,\"niter\":%d,\"niter_cut\":%d,\"energy\":%.14f,"
+                        "\"rss_mb\":%.1f}")
+                 % sw % sweep_time_ % sweep_m_ % sweep_truncerr_ % (nprod_ ? sweep_nprod_ : -1)
+                 % sweep_cut_ % energy % residentMB() << Endl;
+        }
+
+    if(policy_ && sweeps_)
+        {
+        //Back to the sweep's own budget for whoever reads it next
+        if(policy_sw_ == sw) sweeps_->setNiter(sw,table_niter_);
+        total_cut_ += sweep_cut_;
+        Cout << Format("Davidson iteration budget cut by %d this sweep, %d in all") 
+                % sweep_cut_ % total_cut_ << Endl;
+        if(nprod_)
+            Cout << Format("H*phi products made this sweep: %d") % sweep_nprod_ << Endl;
+        sweep_cut_ = 0;
+        }
+    last_dE_ = (sw > 1 ? fabs(energy-last_energy_) : -1);
+    last_energy_ = energy;
+    sweep_time_ = sweep_truncerr_ = 0;
+    sweep_nprod_ = 0;
+    sweep_m_ = 0;
+
     if(Parent::checkDone(sw,svd,energy,opt1,opt2)) 
         return true;
 
+    if(last_sweep_ > 0 && sw >= last_sweep_)
+        return true;
+
+    if(adapt_ && sweeps_ 
+       && adapt_->update(*sweeps_,sw,energy,truncerr,maxm_kept,
+                         (es_accuracy_ > 0 ? fabs(last_es_-curr_es_) : 0)))
+        return true;
+
     if(es_accuracy_ > 0 && fabs(last_es_-curr_es_) < es_accuracy_)
         {
         Cout << Format("\nEntanglement splitting accuracy goal met, %.2E < %.2E.\n") 
@@ -143,11 +791,20 @@ checkDone(int sw, const SVDWorker& svd, Real energy,
         return true;
         }
 
-    if(fileExists("STOP_DMRG"))
+    if(sweeps_)
         {
-        Cout << "File STOP_DMRG found: stopping this DMRG run." << Endl;
-        system("rm -f STOP_DMRG");
-        return true;
+        DMRGSignals& sig = DMRGSignals::get();
+        if(sig.reload)
+            {
+            sig.reload = 0;
+            readControl(sw);
+            }
+        if(sig.stop)
+            {
+            sig.stop = 0;
+            Cout << "Stop requested: stopping this DMRG run." << Endl;
+            return true;
+            }
         }
 
     return false;